@@ -15,8 +15,129 @@
   case scenario is that you have to run this a few time and prune the results (if a student has
   taken 5 classes every term or something like that).
 
+  Large runs can be sharded across any number of processes (on any number of machines). A
+  coordinator seeds registry.enrollment_work with ranges of student ids under its generator's
+  name (so the major and non major generators can share the table), and each worker claims
+  one of its generator's ranges at a time with SELECT ... FOR UPDATE SKIP LOCKED, generates enrollment for it inside
+  a single transaction and marks it done in that same transaction. While it works, a worker renews
+  its lease on a second connection every third of the lease, so a slow range is never taken away
+  from a live worker. A worker that dies or errors out writes nothing for its range; the claim's
+  lease runs out and another worker picks it up.
+
+  Usage:
+    ./embedded_enrollment                          all students
+    ./embedded_enrollment <student_id> [...]       only the given students, e.g. to refill a few
+    ./embedded_enrollment --dry-run [student_id...] plan without writing, print statistics
+    ./embedded_enrollment [--dry-run] --simulate   all students, term by term with prerequisites
+    ./embedded_enrollment --pipeline [planners]    all students, planner threads feeding one COPY writer
+    ./embedded_enrollment --incremental [--listen] students added since the last incremental run
+    ./embedded_enrollment --daemon [socket]        serve requests on a Unix socket (default embedded_enrollment.sock)
+    ./embedded_enrollment --preflight [--fix] [...] check the query plans (and add indexes) before any of the above
+    ./embedded_enrollment --undo <run>             delete exactly the enrollments a run wrote
+    ./embedded_enrollment --replay <run>           write them again, without rerunning the selection
+    ./embedded_enrollment --coordinator [size]     seed work ranges of size student ids (default 100)
+    ./embedded_enrollment --worker [lease_secs]    claim and process ranges until none are left (default 300)
+
+  A leading --dry-run (with any of the first two forms) runs the full selection logic without
+  writing anything, then prints what the run would have produced: enrollments per student and per
+  term, students left empty, how full sections get, the grades the grade generator would hand out
+  against each student's gpa, and why candidate courses were turned down. Use it to tune knobs like
+  threshold before doing a real run.
+
+  The static catalog (majors, courses, sections, prerequisites) is loaded once per run instead of
+  queried per student, and kept in a binary cache file (embedded_enrollment.catalog, or the path
+  in EE_CATALOG) that later runs mmap directly. The cache is rebuilt whenever the row counts or
+  max ids of the catalog tables change. Runs for students given by id skip the catalog altogether:
+  each student is read with a single query that returns everything they need (majors, their
+  courses' sections with seats taken and prerequisites, existing enrollment), so a targeted fix
+  is one round trip per student plus its inserts.
+
+  Sections have a seat capacity, from registry.section.capacity when that column exists and
+  DEFAULT_SECTION_CAPACITY otherwise. Seats taken are counted in memory (seeded from enrollment at
+  startup) and claimed with a compare-and-swap, so it costs no extra query per insert; when the
+  randomly picked section is full the next section of that course that still fits is used. The
+  counts are per process, so separate worker processes each see only their own claims on top of
+  what was in the DB when they started.
+
+  --simulate generates enrollment for everybody at once, term by term in calendar order instead
+  of student by student. Each term, every student who has started gets up to 4 of their majors'
+  courses that are offered that term, that they have not taken, and whose prerequisites they
+  completed in an earlier term, so courses given in earlier terms of the same run unlock later
+  ones. Each term is written with a single COPY. It can be combined with --dry-run. What each
+  student can take is worked out as bitsets over course ids, for a batch of students at a time:
+  eligible = major courses & offered this term & ~taken, with AVX2 when the CPU has it and plain
+  64 bit words otherwise; only the handful of survivors with prerequisites are checked one by one.
+
+  --incremental only generates for students added since the last incremental run. The highest
+  student id processed is kept in registry.enrollment_watermark, and new students are fetched
+  with a range query on the primary key, a chunk at a time, each chunk committed together with
+  the new watermark. Serial ids are handed out before the student commits, so each run also looks
+  at the WATERMARK_SLACK ids just below the watermark for students that still have no enrollment
+  (a student who got none the first time is simply tried again). With --listen it then stays up and runs again whenever something does
+  NOTIFY registry_new_student, e.g. a statement trigger on registry.student:
+    create function registry.notify_new_student() returns trigger language plpgsql as
+      $$ begin perform pg_notify('registry_new_student', ''); return null; end $$;
+    create trigger new_student after insert on registry.student
+      for each statement execute function registry.notify_new_student();
+
+  --pipeline splits the default all students run in two: planner threads (one per CPU but one,
+  or as many as given) each take students from the in-memory student table and pick their courses
+  and sections, pushing the planned (student, crn) rows into a bounded lock-free queue; one writer
+  thread, the only one touching the connection, drains the queue into COPY batches. When the
+  writer falls behind the queue fills and planners wait for room, so memory stays bounded while
+  planning and writing overlap. Seats are claimed with the same atomic counters, and each planner
+  has its own random seed.
+
+  The COPY batch size and how many planners are active (--pipeline), and the students per
+  committed chunk (--incremental), are tuned while the run goes instead of fixed: after each batch
+  or chunk the knob moves a step in its current direction, turns around if throughput dropped, and
+  halves when the server's commit latency per row climbs past 1.5 times the best seen. Every change
+  goes to the debug file, and the settings the run ended on are printed as EE_BATCH=, EE_PLANNERS=
+  and EE_CHUNK=; setting those in the environment (or giving --pipeline a planner count) pins the
+  knob and turns its tuning off.
+
+  --preflight runs EXPLAIN on each per student query (and the grade update) for a real student id
+  and reports every sequential scan on a table of more than PREFLIGHT_LARGE_ROWS rows, since each
+  one is paid again for every student. With --fix, the indexes those queries want on the tables
+  that were scanned (enrollment by student and by crn, section by course, student_major by
+  student, prerequisite by course) are created concurrently where no index leads with that column,
+  and the plans are checked again. Followed by another mode it then goes on to that run; alone it
+  exits 2 if scans are left.
+
+  --daemon keeps the connection, catalog, seat counts and random state warm between jobs and takes
+  one request per line on a Unix socket, answering with any output and then OK (or ERR ...):
+    generate <id> [id...]     generate for these students
+    range <first> <last>      generate for every student id in the range
+    dry-run <id> [id...]      plan for these students and reply with the dry run statistics
+    regrade <id> [id...]      redo the grades of everything these students are enrolled in, and their gpa
+    reload                    reload the catalog and seat counts
+    metrics                   requests, students, enrollments, queries, latency, catalog reloads
+    shutdown
+  e.g.  echo "generate 17 42" | socat - UNIX-CONNECT:embedded_enrollment.sock
+  Requests are served one at a time. Before each one the catalog checksum is compared with the
+  loaded catalog's, and a changed catalog is reloaded. Seat counts are reloaded with it, or by
+  reload; between reloads they only see this daemon's own inserts.
+
+  Every run that writes keeps a journal, embedded_enrollment.<run>.journal in EE_JOURNAL_DIR (default
+  the current directory), where <run> is the start time and pid printed when it starts. It holds the
+  run's random seed and, batch by batch as each commits, the (student_id, crn, grade) rows written;
+  a batch that was rolled back or cut short never reaches it. --undo <run> (or a journal path) COPYs
+  those rows into a temp table and deletes them with one join, --replay <run> inserts the ones that
+  are missing the same way. A leading --seed N fixes the seed (it goes before --dry-run), so a run
+  can be repeated as well as replayed.
+
+  The connection string can be overridden with the EE_CONNINFO environment variable (e.g. to run
+  several local workers against a local PostgreSQL).
+
+  How majors, courses, sections and grades are picked comes from embedded_enrollment_policy.h and
+  is fixed at compile time; embedded_enrollment_non_major.c is this file built with the non major
+  policy.
+
+  Every query, student, section pick and insert has a USDT tracepoint (see embedded_enrollment_trace.h),
+  so a stalled run can be looked at with bpftrace or perf without rebuilding.
+
   Compile as: 
-  gcc -I /usr/include/postgresql -L /usr/lib/postgresql -o embedded_enrollment embedded_enrollment.c.c -lpq
+  gcc -I /usr/include/postgresql -L /usr/lib/postgresql -o embedded_enrollment embedded_enrollment.c -lpq -lpthread
 
 */
 
@@ -24,38 +145,585 @@
 #include <stdlib.h>
 #include <libpq-fe.h>
 #include <string.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include "embedded_enrollment_trace.h"
+#include "embedded_enrollment_registry.h"
+#include "embedded_enrollment_policy.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define DEFAULT_RANGE_SIZE 100
+#define DEFAULT_LEASE_SECS 300
+#define MAX_RANGE_ATTEMPTS 3
+#define MAX_LEDGER 256          //enrollments tracked for one student
+#define STATS_MAX_PER_STUDENT 40
+#define STATS_FILL_BUCKET 5     //section fill histogram bucket width
+
+#define CATALOG_FILE "embedded_enrollment.catalog"
+#define CATALOG_MAGIC "EECATLG"
+#define CATALOG_VERSION 2
+#define DEFAULT_SECTION_CAPACITY 40
+#define ELIGIBLE_BATCH 64       //students per call of the eligibility kernel
+#define WATERMARK_NAME POLICY_WATERMARK
+#define NEW_STUDENT_CHANNEL "registry_new_student"
+#define DEFAULT_SOCKET POLICY_NAME ".sock"
+#define MAX_REQUEST 4096
+#define PLAN_QUEUE_SIZE 65536   //rows between the planners and the writer, a power of two
+#define PIPELINE_BATCH 50000    //rows per COPY the writer starts with
+#define AUTOTUNE_BACKOFF 1.5    //latency per row past this times the best seen means the server is struggling
+#define AUTOTUNE_WORSE 0.95     //throughput below this share of the last window means the last move hurt
+#define PLANNER_CHUNK 64        //students a planner takes at a time
+#define JOURNAL_MAGIC "EEJRNL1"
+#define JOURNAL_VERSION 1
+#define JOURNAL_BATCH_MAGIC 0x48435442u //"BTCH"
+#define PREFLIGHT_LARGE_ROWS 10000  //a sequential scan on a table this big is worth an index
+
+//a course the current student has, either already in enrollment or given to them by this run
+struct ledger_entry
+{
+    int course;
+    int crn;
+    int year;
+    int quarter;
+};
+
+//what generate_student needs to know about one student besides their ledger
+struct student_context
+{
+    int enroll_year;
+    int enroll_term;            //month, compared against quarter_last_month
+    double gpa;
+    int num_majors;
+    int majors[10];
+};
+
+//catalog cache file layout: this header, then the arrays it points to by offset from the start of the file
+struct catalog_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t pad;
+    uint64_t size;              //whole file, header included
+    uint64_t checksum;          //catalog_checksum() of the tables this was built from
+    int32_t max_major;
+    int32_t max_course;
+    int32_t num_major_courses;
+    int32_t num_sections;
+    int32_t num_prereqs;
+    int32_t pad2;
+    uint64_t major_course_start;  //int32_t[max_major + 2], major m's courses are major_courses[start[m]..start[m+1])
+    uint64_t major_courses;
+    uint64_t course_section_start; //int32_t[max_course + 2], same scheme into sections
+    uint64_t sections;
+    uint64_t course_prereq_start;  //int32_t[max_course + 2], same scheme into prereqs
+    uint64_t prereqs;
+};
+
+struct catalog_section
+{
+    int32_t crn;
+    int32_t year;
+    int32_t quarter;
+    int32_t capacity;
+};
+
+//the catalog in memory, either malloc'd from the DB or mapped from the cache file
+struct catalog
+{
+    char *base;
+    size_t size;
+    int mapped;
+    struct catalog_header *hdr;
+    int32_t *major_course_start;
+    int32_t *major_courses;
+    int32_t *course_section_start;
+    struct catalog_section *sections;
+    int32_t *course_prereq_start;
+    int32_t *prereqs;
+};
+
+//every student held in memory (--simulate), one array per field so whole population passes stream
+//through just the columns they read; student s is index s of every array
+struct student_table
+{
+    int count;
+    int max_id;
+    int mask_words;             //uint64_t words of major_mask per student
+    int32_t *id;
+    int32_t *start_term;        //first term they may take, year * NUM_QUARTERS + quarter
+    int16_t *gpa;               //fixed point hundredths, 3.47 is 347
+    uint64_t *major_mask;       //bit m of student s's words is set if they major in m
+    int course_words;           //uint64_t words of taken_bits and done_bits per student
+    uint64_t *taken_bits;       //bit c is set once student s has course c, in any term
+    uint64_t *done_bits;        //bit c is set once student s has completed c, i.e. in a term already simulated
+    int32_t *ledger_start;      //student s's courses are ledger_start[s] .. ledger_start[s] + ledger_len[s]
+    int32_t *ledger_len;        //of a slice ending at ledger_start[s + 1]
+    int32_t *ledger_existing;   //the first ledger_existing[s] of them were already in enrollment
+    int32_t *index;             //student id -> s, -1 for none
+};
+
+//the enrollment ledger all students' slices live in, again one array per field
+struct student_ledger
+{
+    long cap;
+    int32_t *course;
+    int32_t *crn;
+    int32_t *term;
+};
+
+//what the daemon's metrics command reports, since it started
+struct daemon_metrics
+{
+    time_t started;
+    long requests;
+    long failed_requests;
+    long students;
+    long enrollments;
+    long regraded;
+    long catalog_reloads;
+    double busy_ms;
+    double max_request_ms;
+};
+
+//run journal layout: this header once, then one journal_batch and its rows per committed batch, appended as each
+//batch commits. A batch cut short by a crash is ignored when reading, so the journal never claims uncommitted rows.
+struct journal_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t pad;
+    char run_id[32];
+    uint64_t seed;              //what srand() got, so the run can be told apart from a rerun with the same data
+    int64_t started;            //unix time
+};
+
+struct journal_batch
+{
+    uint32_t magic;
+    uint32_t rows;
+};
+
+struct journal_row
+{
+    int32_t student_id;
+    int32_t crn;
+    char grade[4];              //empty for rows inserted without a grade
+};
+
+//the journal of the run in progress; rows wait in buffer until their batch commits
+struct journal
+{
+    FILE *file;
+    char run_id[32];
+    struct journal_row *buffer;
+    int count;
+    int cap;
+};
+
+//a per student query the generators run, $1 standing for the student id
+struct preflight_query
+{
+    const char *name;
+    const char *sql;
+};
+
+//an index the per student queries want, created by --preflight --fix when its table gets sequentially scanned
+struct preflight_index
+{
+    const char *table;
+    const char *column;
+    const char *create;
+};
+
+//one slot of the plan queue; seq says whose turn the slot is (Vyukov's bounded queue)
+struct plan_cell
+{
+    uint64_t seq;
+    int32_t student_id;
+    int32_t crn;
+};
+
+//bounded lock-free queue of planned (student, crn) rows, any number of planners in, one writer out;
+//head and tail sit on their own cache lines so producers and the consumer don't keep stealing them
+struct plan_queue
+{
+    struct plan_cell *cells;
+    uint64_t mask;
+    char pad0[64];
+    uint64_t head;              //next slot a planner will claim
+    char pad1[64];
+    uint64_t tail;              //next slot the writer will read
+    char pad2[64];
+    int planners_left;
+    int active_planners;        //planners with an index below this plan, the rest wait; set by the writer
+    long full_waits;            //times a planner found the queue full and had to wait for the writer
+};
+
+//what each planner thread works from
+struct planner_args
+{
+    struct plan_queue *queue;
+    int index;
+    unsigned int seed;
+    long planned;
+};
+
+//one knob tuned during a run from the run's own throughput (rows per second of a window) and server
+//latency (ms per row the server took to commit the window): it climbs in its current direction while
+//throughput holds, turns around when a move made it worse, and halves when latency rises past
+//AUTOTUNE_BACKOFF times the best seen
+struct autotune
+{
+    const char *name;
+    const char *env;            //environment variable that pins it
+    int value;
+    int min;
+    int max;
+    int step;
+    int backoff;                //whether latency counts, for knobs that put load on the server
+    int pinned;
+    int direction;
+    double last_rate;
+    double best_latency;
+    int changes;
+};
+
+//a course a student already had before the run, counted as completed once the simulation is past its term
+struct pending_done
+{
+    int32_t term;
+    int32_t s;
+    int32_t course;
+};
+
+struct term_count
+{
+    int year;
+    int quarter;
+    long count;
+};
+
+struct crn_count
+{
+    int crn;
+    long count;
+};
+
+//everything a dry run reports
+struct run_stats
+{
+    long students;
+    long enrollments;
+    long per_student[STATS_MAX_PER_STUDENT + 1]; //last bucket holds everything above
+    struct term_count *terms;
+    int num_terms;
+    int cap_terms;
+    struct crn_count *sections; //open addressing on crn, cap_sections is a power of two
+    int num_sections;
+    int cap_sections;
+    long rejected_threshold;
+    long rejected_enrolled;
+    long rejected_no_sections;
+    long rejected_too_early;
+    long rejected_term_full;
+    long rejected_section_full;
+    long rejected_prereq;
+    long grades[NUM_GRADES];
+    int graded_students;
+    double target_gpa_sum;
+    double sim_gpa_sum;
+    double gpa_abs_err_sum;
+};
+
+int generate_student(PGconn *conn, FILE *f, int student_id);
+int fetch_student(PGconn *conn, FILE *f, int student_id, struct student_context *ctx);
+int fetch_student_context(PGconn *conn, FILE *f, int student_id, struct student_context *ctx);
+int run_coordinator(PGconn *conn, FILE *f, int range_size);
+int run_worker(PGconn *conn, FILE *f, int lease_secs);
+int renew_lease(PGconn *lease_conn, const char *const *renew_params);
+void usage(void);
+int get_first_term(char *enroll_date, int year_or_term);
+int ledger_has_course(int course);
+int ledger_in_term(int year, int quarter);
+void stats_count_term(int year, int quarter);
+void stats_count_section(int crn);
+void stats_finish_student(double gpa, int num_planned);
+int compare_terms(const void *a, const void *b);
+void print_dry_run_stats(PGconn *conn, FILE *out);
+void reset_stats(void);
+uint64_t catalog_checksum(PGconn *conn);
+void catalog_open(PGconn *conn, struct catalog *cat, FILE *f);
+void catalog_close(struct catalog *cat);
+int count_rows(PGresult *res, int col);
+void catalog_build(PGconn *conn, struct catalog *cat, uint64_t checksum, PGresult *maj_res, int maj_major_col, int maj_course_col,
+                   PGresult *sec_res, int sec_course_col, PGresult *pre_res, int pre_course_col, int pre_req_col);
+int32_t *catalog_major_courses(struct catalog *cat, int major, int *count);
+struct catalog_section *catalog_course_sections(struct catalog *cat, int course, int *count);
+int32_t *catalog_course_prereqs(struct catalog *cat, int course, int *count);
+void load_seats(PGconn *conn);
+int section_by_crn(int crn);
+int claim_seat(struct catalog_section *section);
+void release_seat(struct catalog_section *section);
+struct catalog_section *section_fits(struct catalog_section *section, int enroll_year, int enroll_term);
+int section_course(int k);
+void load_students(PGconn *conn);
+void free_students(void);
+void student_add_course(int s, int course, int crn, int term);
+int student_has_course(int s, int course, int before_term);
+int student_in_term(int s, int term);
+int next_major(int s, int after);
+void eligible_scalar(const uint64_t *major, const uint64_t *taken, const uint64_t *offered, uint64_t *out, int words, int n);
+void eligible_avx2(const uint64_t *major, const uint64_t *taken, const uint64_t *offered, uint64_t *out, int words, int n);
+void pick_eligible_kernel(FILE *f);
+int prereqs_done(int s, int course);
+int compare_pending_done(const void *a, const void *b);
+int run_simulation(PGconn *conn, FILE *f);
+int run_delta(PGconn *conn, FILE *f);
+int run_incremental(PGconn *conn, FILE *f, int listen);
+int regrade_student(PGconn *conn, FILE *f, int student_id);
+void daemon_refresh_catalog(PGconn *conn, FILE *f, int force);
+int daemon_request(PGconn *conn, FILE *f, char *line, FILE *out);
+int run_daemon(PGconn *conn, FILE *f, const char *path);
+int plan_push(struct plan_queue *queue, int student_id, int crn);
+int plan_pop(struct plan_queue *queue, int *student_id, int *crn);
+int plan_student(int s, unsigned int *seed, struct plan_queue *queue);
+void *planner_thread(void *arg);
+int run_pipeline(PGconn *conn, FILE *f, int num_planners);
+double now_ms(void);
+void autotune_init(struct autotune *knob, const char *name, const char *env, int value, int min, int max, int step, int backoff);
+int autotune_sample(struct autotune *knob, FILE *f, double rows, double elapsed_ms, double latency_ms);
+void autotune_report(struct autotune *knob, FILE *f);
+char *bind_student(const char *sql, int student_id);
+int has_leading_index(PGconn *conn, const char *table, const char *column);
+int preflight_scans(PGconn *conn, FILE *f, int student_id, int fix);
+int run_preflight(PGconn *conn, FILE *f, int fix);
+void journal_open(FILE *f, uint64_t seed);
+void journal_add(int student_id, int crn);
+void journal_commit(void);
+void journal_discard(void);
+void journal_close(void);
+struct journal_row *journal_read(const char *run, struct journal_header *hdr, long *count);
+int run_undo_replay(PGconn *conn, FILE *f, const char *run, int replay);
+
+const int DEBUG = 1;
+
+//set while a worker is processing a claimed range, so errors release the range instead of exiting
+jmp_buf *worker_jmp = NULL;
+//set while inserts run inside a transaction that a failed insert would abort
+int in_transaction = 0;
+//set while the daemon serves a request, so errors fail just that request
+jmp_buf *request_jmp = NULL;
+
+struct daemon_metrics metrics;
+
+struct journal journal;
+uint64_t run_seed = 0;
+//what the run connected with, for the worker's lease connection
+const char *conn_info = NULL;
+//dry run grading draws from here instead of rand(), so --dry-run --seed N selects exactly what the real run would
+unsigned int grade_seed = 0;
+
+int dry_run = 0;
+//students named on the command line are fetched with one context query each, without the full catalog
+int targeted = 0;
+struct run_stats stats;
+
+struct catalog catalog;
+
+//seats taken per catalog section (same index as catalog.sections), only ever changed atomically
+int32_t *seats_taken = NULL;
+//catalog section indexes ordered by crn, for turning enrollment rows into seat counts
+int32_t *crn_order = NULL;
+
+struct student_table students;
+struct student_ledger ledger_cols;
+
+//eligible = major & offered & ~taken over a batch of students, picked once per run by what the CPU supports
+void (*eligible_kernel)(const uint64_t *, const uint64_t *, const uint64_t *, uint64_t *, int, int) = eligible_scalar;
+
+//the current student's courses; ledger[0..num_existing) came from the DB, the rest are from this run
+struct ledger_entry ledger[MAX_LEDGER];
+int num_ledger = 0;
+int num_existing = 0;
+
+void usage(void)
+{
+    fprintf(stderr, "Usage: %s [--preflight [--fix]] [--seed N] [--dry-run] [mode]\n"
+                    "  (none)                 all students\n"
+                    "  <student_id> [...]     only the given students\n"
+                    "  --simulate             all students, term by term\n"
+                    "  --pipeline [planners]  all students, planner threads feeding one COPY writer\n"
+                    "  --incremental [--listen]\n"
+                    "  --daemon [socket]\n"
+                    "  --undo <run> | --replay <run>\n"
+                    "  --coordinator [size] | --worker [lease_secs]\n", POLICY_NAME);
+}
 
 int exit_nicely(PGconn *conn, char *loc)
 {
+    if (worker_jmp)
+    {
+        fprintf(stderr, "\n*****Whoa, had and issue (%s)! Releasing range\n", loc);
+        longjmp(*worker_jmp, 1);
+    }
+
+    if (request_jmp)
+    {
+        fprintf(stderr, "\n*****Whoa, had and issue (%s)! Failing request\n", loc);
+        longjmp(*request_jmp, 1);
+    }
+
     PQfinish(conn);
     fprintf(stderr, "\n*****Whoa, had and issue (%s)! Exiting\n", loc);
     exit(1);
 }
 
-
 int main(int argc, char *argv[])
 {
-    const int DEBUG = 1;
-    FILE *f = fopen("debug_output.txt", "w");
-    if (f == NULL)
+    int coordinator = 0;
+    int worker = 0;
+    int simulate = 0;
+    int incremental = 0;
+    int listen = 0;
+    int daemon_mode = 0;
+    int pipeline = 0;
+    int num_planners = 0;
+    int preflight = 0;
+    int preflight_fix = 0;
+    int seeded = 0;
+    const char *undo_run = NULL;
+    const char *replay_run = NULL;
+    const char *socket_path = DEFAULT_SOCKET;
+    int range_size = DEFAULT_RANGE_SIZE;
+    int lease_secs = DEFAULT_LEASE_SECS;
+
+    if (argc > 1 && strcmp(argv[1], "--preflight") == 0)
     {
-        fprintf(stderr, "Issue opening output file\n");
-        exit (1);
+        preflight = 1;
+        argc--;
+        argv++;
+        if (argc > 1 && strcmp(argv[1], "--fix") == 0)
+        {
+            preflight_fix = 1;
+            argc--;
+            argv++;
+        }
+
+        //on its own it only checks; anything after it is the run to do once the check is over
+        if (argc < 2)
+            preflight = 2;
+    }
+
+    if (argc > 2 && strcmp(argv[1], "--seed") == 0)
+    {
+        run_seed = strtoull(argv[2], NULL, 10);
+        seeded = 1;
+        argc -= 2;
+        argv += 2;
     }
 
-    int input_student_id = 0;
+    if (argc > 1 && strcmp(argv[1], "--dry-run") == 0)
+    {
+        dry_run = 1;
+        argc--;
+        argv++;
+    }
 
     if (argc < 2)
-        fprintf(stderr, "NOTE: You are executing with no student_id, and therefore will execute on all students\n");
+    {
+        if (preflight != 2)
+            fprintf(stderr, "NOTE: You are executing with no student_id, and therefore will execute on all students\n");
+    }
+    else if (strcmp(argv[1], "--coordinator") == 0)
+    {
+        coordinator = 1;
+        if (argc > 2)
+            range_size = atoi(argv[2]);
+    }
+    else if (strcmp(argv[1], "--worker") == 0)
+    {
+        worker = 1;
+        if (argc > 2)
+            lease_secs = atoi(argv[2]);
+    }
+    else if (strcmp(argv[1], "--simulate") == 0)
+        simulate = 1;
+    else if (strcmp(argv[1], "--incremental") == 0)
+    {
+        incremental = 1;
+        listen = argc > 2 && strcmp(argv[2], "--listen") == 0;
+    }
+    else if (strcmp(argv[1], "--pipeline") == 0)
+    {
+        pipeline = 1;
+        if (argc > 2)
+            num_planners = atoi(argv[2]);
+    }
+    else if (strcmp(argv[1], "--undo") == 0 && argc > 2)
+        undo_run = argv[2];
+    else if (strcmp(argv[1], "--replay") == 0 && argc > 2)
+        replay_run = argv[2];
+    else if (strcmp(argv[1], "--daemon") == 0)
+    {
+        daemon_mode = 1;
+        if (argc > 2)
+            socket_path = argv[2];
+    }
+    else if (argv[1][0] == '-')
+    {
+        fprintf(stderr, "Unknown argument %s\n", argv[1]);
+        usage();
+        exit (1);
+    }
+    else
+        targeted = 1;
+
+    if (dry_run && (coordinator || worker || incremental || daemon_mode || pipeline || undo_run || replay_run))
+    {
+        fprintf(stderr, "--dry-run only plans single students or the whole registry\n");
+        exit (1);
+    }
+
+    if (range_size < 1 || lease_secs < 1)
+    {
+        fprintf(stderr, "Range size and lease must be positive\n");
+        exit (1);
+    }
+
+    //several workers usually share a directory, so each gets its own debug file
+    char debug_name[64];
+    if (worker)
+        sprintf(debug_name, "debug_output.%d.txt", (int) getpid());
+    else
+        strcpy(debug_name, "debug_output.txt");
 
-    if (argc == 2)
-        input_student_id = atoi(argv[1]);
+    FILE *f = fopen(debug_name, "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Issue opening output file\n");
+        exit (1);
+    }
 
-    const char *conn_info;
     PGconn *conn;
     PGresult *res;
 
-    conn_info = "host=dbclass.cs.pdx.edu user=w15db71 password=secret";
+    conn_info = getenv("EE_CONNINFO");
+    if (conn_info == NULL)
+        conn_info = "host=dbclass.cs.pdx.edu user=w15db71 password=secret";
     conn = PQconnectdb(conn_info);
 
     if (PQstatus(conn) != CONNECTION_OK)
@@ -64,374 +732,3180 @@ int main(int argc, char *argv[])
         return -1;
     }
 
-    char *student_buffer = (char *) malloc (sizeof(char) * 1024);
-    sprintf(student_buffer, "select s.id from registry.student s;");    
-    res = PQexec(conn, student_buffer);
+    if (preflight)
+    {
+        int slow = run_preflight(conn, f, preflight_fix);
+        if (preflight == 2)
+        {
+            PQfinish(conn);
+            return slow ? 2 : 0;
+        }
+    }
 
-    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+    if (coordinator)
     {
-        free(student_buffer);
-        exit_nicely(conn, "Getting student records");
+        int status = run_coordinator(conn, f, range_size);
+        PQfinish(conn);
+        return status;
     }
 
-    int NUM_STUD = PQntuples(res);
+    if (undo_run || replay_run)
+    {
+        int status = run_undo_replay(conn, f, undo_run ? undo_run : replay_run, replay_run != NULL);
+        PQfinish(conn);
+        return status;
+    }
+
+    //every run that writes keeps a journal of what it wrote, so it can be undone or replayed later
+    if (!seeded)
+        run_seed = (uint64_t) time(NULL) ^ ((uint64_t) getpid() << 16);
+    srand((unsigned int) run_seed);
+    grade_seed = (unsigned int) (run_seed ^ (run_seed >> 32)) ^ 0x9e3779b9u;
+    if (!dry_run)
+        journal_open(f, run_seed);
+
+    //students given by id each bring their own slice of the catalog, see fetch_student_context
+    if (targeted && POLICY_STUDENT_SLICE)
+    {
+        int k;
+        for (k = 1; k < argc; k++)
+            generate_student(conn, f, atoi(argv[k]));
+
+        if (dry_run)
+            print_dry_run_stats(conn, stdout);
+        catalog_close(&catalog);
+        PQfinish(conn);
+        return 0;
+    }
 
-    //start from beginning to generate enrollment for all student
-    int i = 1;     
-    //if student_id provided at cli, only do so for one student
-    if (input_student_id)
+    catalog_open(conn, &catalog, f);
+    seats_taken = (int32_t *) calloc(catalog.hdr->num_sections + 1, sizeof(int32_t));
+    load_seats(conn);
+
+    //a policy that offers courses outside the student's majors needs the whole catalog even for a few ids
+    if (targeted)
+    {
+        int k;
+        for (k = 1; k < argc; k++)
+            generate_student(conn, f, atoi(argv[k]));
+
+        if (dry_run)
+            print_dry_run_stats(conn, stdout);
+        catalog_close(&catalog);
+        PQfinish(conn);
+        return 0;
+    }
+
+    if (worker)
+    {
+        int status = run_worker(conn, f, lease_secs);
+        catalog_close(&catalog);
+        PQfinish(conn);
+        return status;
+    }
+
+    if (pipeline)
+    {
+        int status = run_pipeline(conn, f, num_planners);
+        catalog_close(&catalog);
+        PQfinish(conn);
+        return status;
+    }
+
+    if (daemon_mode)
+    {
+        int status = run_daemon(conn, f, socket_path);
+        catalog_close(&catalog);
+        PQfinish(conn);
+        return status;
+    }
+
+    if (incremental)
+    {
+        int status = run_incremental(conn, f, listen);
+        catalog_close(&catalog);
+        PQfinish(conn);
+        return status;
+    }
+
+    if (simulate)
     {
-        i = input_student_id;
-        NUM_STUD = i;
+        run_simulation(conn, f);
+        if (dry_run)
+            print_dry_run_stats(conn, stdout);
+        catalog_close(&catalog);
+        PQfinish(conn);
+        return 0;
     }
 
+    //walk the ids that exist rather than 1..count, they need not be dense or start at 1
+    res = traced_exec(conn, "select s.id from registry.student s order by s.id;");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+        exit_nicely(conn, "Getting student records");
+
+    int NUM_STUD = PQntuples(res);
     if (DEBUG)
         fprintf(f, "NUM_STUD = %d\n", NUM_STUD);
 
     //Iterate through records FOR EACH STUDENT, joining and finding courses and CRNs to add to enrollment
-    PGresult *enroll_date_res;
-    PGresult *maj_res;    
-    for (i; i <= NUM_STUD; i++)
-    {
-        //First, snag the students enrollment date
-        char *enroll_date_buffer = (char *) malloc(sizeof(char) * 1024);
-        sprintf(enroll_date_buffer, "select s.enrollment_date from registry.student s where s.id=%d;", i);
-        enroll_date_res = PQexec(conn, enroll_date_buffer);
+    int i;
+    for (i = 0; i < NUM_STUD; i++)
+        generate_student(conn, f, atoi(PQgetvalue(res, i, 0)));
+    PQclear(res);
 
-        if (PQntuples(enroll_date_res) < 1)
-        {
-            PQclear(enroll_date_res);
-            continue;
-        }
+    if (dry_run)
+        print_dry_run_stats(conn, stdout);
 
-        if (PQresultStatus(enroll_date_res) != PGRES_TUPLES_OK)
-        {
-            free(enroll_date_buffer);
-            exit_nicely(conn, "Getting enrollment date for student");
-        } 
+    catalog_close(&catalog);
+    PQfinish(conn);
+    return 0;
+}
+
+int generate_student(PGconn *conn, FILE *f, int student_id)
+{
+    int64_t student_started = TRACE_NOW(student_done);
+    trace_student = student_id;
+    TRACE_STUDENT_START(student_id);
 
-        char *enroll_date_full = (char*) malloc(sizeof(char) * 15);
-        enroll_date_full = PQgetvalue(enroll_date_res, 0, 0);
-        int enroll_year, enroll_term;
-        enroll_year = get_first_term(enroll_date_full, 0);
-        enroll_term = get_first_term(enroll_date_full, 1);
+    struct student_context ctx;
+    int found = targeted && POLICY_STUDENT_SLICE ? fetch_student_context(conn, f, student_id, &ctx) : fetch_student(conn, f, student_id, &ctx);
+    if (!found)
+    {
+        TRACE_STUDENT_DONE(student_id, 0, TRACE_SINCE(student_started));
+        trace_student = 0;
+        return 0;
+    }
 
-        //Find major(s) for this student (join student & student_major on student_id and student_major & major on major_id
-        char *maj_buffer = (char *) malloc(sizeof(char) * 1024);
-        sprintf(maj_buffer, "select maj.id from registry.student s join registry.student_major sm on s.id=sm.student_id join registry.major maj on sm.major_id=maj.id where s.id=%d;", i);
-        
-        maj_res = PQexec(conn, maj_buffer);
-        if (PQresultStatus(maj_res) != PGRES_TUPLES_OK)
-        {
-            free(maj_buffer);
-            exit_nicely(conn, "Getting majors for student");
-        }
+    int enroll_year = ctx.enroll_year;
+    int enroll_term = ctx.enroll_term;
+    double gpa = ctx.gpa;
+    int majors[10];
+    int NUM_MAJ = policy_majors(ctx.majors, ctx.num_majors, majors, 10, catalog.hdr->max_major, NULL);
+    char *student_buffer = (char *) malloc(sizeof(char) * 1024);
 
-        int NUM_MAJ = PQntuples(maj_res);
+    int j;
+    for (j = 0; j < NUM_MAJ; j++)
+    {
+        //access each major as majors[j]
+        int NUM_COURSES;
+        int32_t *courses = catalog_major_courses(&catalog, majors[j], &NUM_COURSES);
         if (DEBUG)
-            fprintf(f, "Student %d has %d majors\n", i, NUM_MAJ);
+            fprintf(f, "\t\tMajor %d has %d courses\n", majors[j], NUM_COURSES);
 
-        int majors [10];
-        int majoriterate;
-        for (majoriterate = 0; majoriterate < NUM_MAJ; majoriterate++)
+        int courseiterate;
+        for (courseiterate = 0; courseiterate < NUM_COURSES; courseiterate++)
         {
-            majors[majoriterate] = atoi(PQgetvalue(maj_res, majoriterate, 0));
             if (DEBUG)
-                fprintf(f, "\tStudents major(s) are: %d\n", majors[majoriterate]);
-        }
+                fprintf(f, "\t\t\tMajor %d includes course %d\n", majors[j], courses[courseiterate]);
 
-        int j;
-        PGresult *course_of_maj_res;
-        for (j = 0; j < NUM_MAJ; j++)
-        {
-            //access each major as majors[j] 
-            char *course_buffer = (char *) malloc(sizeof(char) * 1024);
-            sprintf(course_buffer, "select c.id from registry.major m join registry.department d on m.department_id=d.id join registry.course c on d.id=c.department_id where m.id=%d;", majors[j]);
-            course_of_maj_res = PQexec(conn, course_buffer);
-
-            if (PQresultStatus(course_of_maj_res) != PGRES_TUPLES_OK)
+            //randomly select which courses to continue on this path (to potential registration)
+            if (!policy_accept_course(NULL))
             {
-                free(course_buffer);
-                exit_nicely(conn, "Getting course for major");
-            } 
-
-            int NUM_COURSES = PQntuples(course_of_maj_res);
-            if (DEBUG)
-                fprintf(f, "\t\tMajor %d has %d courses\n", majors[j], NUM_COURSES);
+                stats.rejected_threshold++;
+                TRACE_COURSE_REJECT(student_id, courses[courseiterate], "threshold");
+                continue;
+            }
+
+            //check if course has a prerequisite
+            int NUM_REQ;
+            int32_t *prereq_list = catalog_course_prereqs(&catalog, courses[courseiterate], &NUM_REQ);
+            if (0) //prereq needed
+            {
+                //prereq required. See if it's been taken!
+                int cancel = 0;
+                int k;
+                for (k = 0; k < NUM_REQ; k++)
+                {
+                    if (!ledger_has_course(prereq_list[k]))
+                    {
+                        cancel = 1;
+                        break;
+                    }
+                }
 
-            PGresult *insert_res;
-            int courses [25];
-            int courseiterate;
-            for (courseiterate = 0; courseiterate < NUM_COURSES; courseiterate++)
+                if (cancel > 0)
+                {
+                    stats.rejected_prereq++;
+                    continue;
+                }
+            }
+            else
             {
-                courses[courseiterate] = atoi(PQgetvalue(course_of_maj_res, courseiterate, 0));
-                if (DEBUG)
-                    fprintf(f, "\t\t\tMajor %d includes course %d\n", majors[j], courses[courseiterate]);
-
-                //randomly select which courses to continue on this path (to potential registration)
-                int threshold = 3; //this number must be beat by rand in order to continue on path
-                int rand = rand_lim(30);
-                if (rand < threshold)
+                //check if already enrolled
+                if (ledger_has_course(courses[courseiterate]))
+                {
+                    stats.rejected_enrolled++;
+                    TRACE_COURSE_REJECT(student_id, courses[courseiterate], "enrolled");
+                    fprintf(f, "%d Has already taken %d! \n", student_id, courses[courseiterate]);
                     continue;
+                }
 
-                //check if course has a prerequisite
-                int *prereq_list = (int*)malloc (sizeof(int) * 10);
-                int req = check_prereq(conn, courses[courseiterate], prereq_list);
-                if (0) //prereq needed
+                int NUM_SECTIONS;
+                struct catalog_section *sections = catalog_course_sections(&catalog, courses[courseiterate], &NUM_SECTIONS);
+                if (NUM_SECTIONS < 1)
                 {
-                    //prereq required. See if it's been taken!
-                    int cancel = 0;
-                    int k = 0;
-                    while (prereq_list[k]) 
-                    {
-                        char *taken_buff = (char*) malloc(sizeof(char) * 1024);
-                        sprintf(taken_buff, "select e.student_id from registry.enrollment e join registry.section s on s.crn=e.crn where s.course_id=%d and e.student_id=%d;", prereq_list[k], i);
-                        PGresult *taken_res = PQexec(conn, taken_buff);
+                    stats.rejected_no_sections++;
+                    TRACE_COURSE_REJECT(student_id, courses[courseiterate], "no_sections");
+                    continue;
+                }
 
-                        if (PQresultStatus(taken_res) != PGRES_TUPLES_OK)
-                        {
-                            free(taken_buff);
-                            exit_nicely(conn, "Checking which prereqs have been taken");
-                        }
- 
-                        if (PQntuples(taken_res) < 1)
-                        {
-                            cancel = 1;
-                            break;
-                        }
-                        k++;
-                        PQclear(taken_res);
-                    }
+                //Parse data if all looks good
+                int retry = 3;
+                int enroll_time = 0;
+                while((retry >= 0) && (enroll_time == 0) )
+                {
+                    retry--;
+                    //randomly select a section
+                    struct catalog_section *section = &sections[policy_first_section(NUM_SECTIONS, NULL)];
 
-                    if (cancel > 0)
-                        continue;
-                }
-                else
-                { 
-                    //check if already enrolled
-                    int enrolled = already_enrolled(conn, i, courses[courseiterate]);
-                    if (enrolled < 0)
+                    //Section MUST be after enroll_year and enroll_term
+                    if (enroll_year > section->year ||
+                        (enroll_year == section->year && enroll_term > quarter_last_month[section->quarter]))
                     {
-                        fprintf(f, "%d Has already taken %d! \n", i, courses[courseiterate]);
+                        stats.rejected_too_early++;
+                        TRACE_COURSE_REJECT(student_id, courses[courseiterate], "too_early");
+                        enroll_time = 1;
                         continue;
                     }
 
-                    //Join course and section on course_id, 
-                    char *section_buff = (char *) malloc(sizeof(char) * 1024);
-                    sprintf(section_buff, "select distinct s.crn, s.quarter, s.year from registry.section s join registry.course c on s.course_id=%d;", courses[courseiterate]);
-                    PGresult *section_res = PQexec(conn, section_buff);
- 
-                    if (PQresultStatus(section_res) != PGRES_TUPLES_OK)
+                    //Finally, check that they have < 4 records for that term
+                    if (ledger_in_term(section->year, section->quarter) > 3)
                     {
-                        free(section_buff);
-                        exit_nicely(conn, "Joining Section & Course");
-                    }
-
-                    int NUM_SECTIONS = PQntuples(section_res);
-                    if (NUM_SECTIONS < 1)
-                    {
-                        PQclear(section_res);
+                        stats.rejected_term_full++;
+                        TRACE_COURSE_REJECT(student_id, courses[courseiterate], "term_full");
                         continue;
                     }
 
-                    //Parse data if all looks good
-                    int retry = 3;
-                    int enroll_time = 0;
-                    int CRN = 0;
-                    while((retry >= 0) && (enroll_time == 0) )
+                    //take a seat, falling back to the next section of the course that fits if this one is full
+                    if (!claim_seat(section))
                     {
-                        retry--;
-                        //randomly select a section
-                        int rand_sec = rand_lim(NUM_SECTIONS);
-
-                        CRN = atoi(PQgetvalue(section_res, rand_sec, 0));
-                        char *quarter = (char*) malloc(sizeof(char) * 10);
-                        quarter = PQgetvalue(section_res, rand_sec, 1);
-                        int sec_year = atoi(PQgetvalue(section_res, rand_sec, 2));
-
-                        //Section MUST be after enroll_year and enroll_term
-                        if (enroll_year > sec_year)
-                        {
-                            enroll_time = 1;
-                            continue;
-                        }
-
-                        if (enroll_year == sec_year)
-                        {
-                            if (strcmp(quarter, "Winter") == 0)
-                            {
-                                if (enroll_term > 2)
-                                {
-                                    enroll_time = 1;
-                                    continue;
-                                }
-                            }
-                            else if (strcmp(quarter, "Spring") == 0)
-                            {
-                                if (enroll_term > 4)
-                                {
-                                    enroll_time = 1;
-                                    continue;
-                                }
-                            }
-                            else if (strcmp(quarter, "Summer") == 0)
-                            {
-                                if (enroll_term > 7)
-                                {
-                                    enroll_time = 1;
-                                    continue;
-                                }
-                            }
-                            else if (strcmp(quarter, "Fall") == 0)
-                            {
-                                if (enroll_term > 10)
-                                {
-                                    enroll_time = 1;
-                                    continue;
-                                }
-                            }
-                            else
-                            {
-                                fprintf(stderr, "Error Parsing Term\n");
-                            }
-                        } 
-                        
-                        //Finally, check that they have < 4 records for that term
-                        char *limit_buff = (char *)malloc(sizeof(char) * 1024);
-                        sprintf(limit_buff, "select distinct s.crn from registry.section s join registry.enrollment e on s.crn = e.crn where e.student_id=%d and s.year = %d and s.quarter=\'%s\';", i, sec_year, quarter);
-                        PGresult *limit_res = PQexec(conn, limit_buff);
-
-                        if (PQresultStatus(limit_res) != PGRES_TUPLES_OK)
+                        struct catalog_section *fallback = NULL;
+                        int k;
+                        for (k = 1; k < NUM_SECTIONS && fallback == NULL; k++)
                         {
-                            free(limit_buff);
-                            exit_nicely(conn, "Checking LIMIT of student classes per term");
+                            struct catalog_section *next = &sections[(section - sections + k) % NUM_SECTIONS];
+                            if (section_fits(next, enroll_year, enroll_term) && claim_seat(next))
+                                fallback = next;
                         }
 
-                        int LIM_SECTIONS = PQntuples(limit_res);
-                        if (LIM_SECTIONS > 3)
+                        if (fallback == NULL)
                         {
-                            PQclear(limit_res);
-                            continue;
+                            stats.rejected_section_full++;
+                            TRACE_COURSE_REJECT(student_id, courses[courseiterate], "section_full");
+                            break;
                         }
+                        section = fallback;
+                    }
+                    TRACE_SECTION_SELECT(student_id, courses[courseiterate], section->crn);
 
-                        //add that student/crn to enrollment
-                        char *insert_buff = (char *)malloc (sizeof(char) * 1024);
-                        sprintf(insert_buff, "insert into registry.enrollment values(%d, %d);", i, CRN);
-                        fprintf(f, "INSERTING: %s\n", insert_buff);
-                        insert_res = PQexec(conn, insert_buff);
+                    if (num_ledger < MAX_LEDGER)
+                    {
+                        ledger[num_ledger].course = courses[courseiterate];
+                        ledger[num_ledger].crn = section->crn;
+                        ledger[num_ledger].year = section->year;
+                        ledger[num_ledger].quarter = section->quarter;
+                        num_ledger++;
+                    }
 
+                    if (dry_run)
+                    {
+                        stats_count_term(section->year, section->quarter);
+                        stats_count_section(section->crn);
+                        if (DEBUG)
+                            fprintf(f, "WOULD INSERT: %d, %d\n", student_id, section->crn);
                         break;
-                    }// while retry loop (sections per course)
-                }
+                    }
+
+                    //add that student/crn to enrollment
+                    sprintf(student_buffer, "insert into registry.enrollment values(%d, %d);", student_id, section->crn);
+                    fprintf(f, "INSERTING: %s\n", student_buffer);
+                    int64_t insert_started = TRACE_NOW(insert);
+                    PGresult *insert_res = traced_exec(conn, student_buffer);
+                    TRACE_INSERT(student_id, section->crn, TRACE_SINCE(insert_started));
+
+                    if (PQresultStatus(insert_res) != PGRES_COMMAND_OK)
+                    {
+                        release_seat(section);
+                        fprintf(f, "INSERT FAILED: %s", PQerrorMessage(conn));
+                        //a failed insert aborts the surrounding transaction (a worker's range, an incremental chunk)
+                        if (worker_jmp || in_transaction)
+                            exit_nicely(conn, "Inserting enrollment");
+                    }
+                    else
+                    {
+                        //outside a transaction the insert has committed on its own
+                        journal_add(student_id, section->crn);
+                        if (!worker_jmp && !in_transaction)
+                            journal_commit();
+                    }
+                    PQclear(insert_res);
 
-                //PQclear(insert_res);                
+                    break;
+                }// while retry loop (sections per course)
+            }
 
-            } //for: check prereq, insert row
+        } //for: check prereq, insert row
 
-            PQclear(course_of_maj_res);
+    } //for: courses per major
 
-        } //for: courses per major
+    if (dry_run)
+        stats_finish_student(gpa, num_ledger - num_existing);
 
-        PQclear(enroll_date_res);
-        PQclear(maj_res);
-    } //for: majors per student
- 
+    TRACE_STUDENT_DONE(student_id, num_ledger - num_existing, TRACE_SINCE(student_started));
+    trace_student = 0;
     free(student_buffer);
-    PQclear(res);
-    PQfinish(conn);
-    return 0;
+    return num_ledger - num_existing;
 }
 
-int get_first_term(char *enroll_date, int year_or_term)
+//reads the student, their majors and their existing enrollment into ctx and the ledger; 0 if there is no such student
+int fetch_student(PGconn *conn, FILE *f, int student_id, struct student_context *ctx)
 {
-    //parse enroll_date and return
-    char *buffer = (char *) malloc(sizeof(char) * 20);
-    int start, finish;
+    //the catalog is already in memory, so the only rows read here are this student's own
+    char *student_buffer = (char *) malloc(sizeof(char) * 1024);
+    sprintf(student_buffer, "select s.enrollment_date, s.gpa from registry.student s where s.id=%d;", student_id);
+    PGresult *enroll_date_res = traced_exec(conn, student_buffer);
 
-    if (year_or_term == 0) //parse for year
+    if (PQresultStatus(enroll_date_res) != PGRES_TUPLES_OK)
     {
-        start = 0;
-        finish = 3;
+        free(student_buffer);
+        exit_nicely(conn, "Getting enrollment date for student");
     }
-    else //parse for month
+
+    if (PQntuples(enroll_date_res) < 1)
     {
-        start = 5;
-        finish = 6;
+        free(student_buffer);
+        PQclear(enroll_date_res);
+        return 0;
     }
-    int i = 0;
-    for (start; start <= finish; start++)
+
+    ctx->enroll_year = get_first_term(PQgetvalue(enroll_date_res, 0, 0), 0);
+    ctx->enroll_term = get_first_term(PQgetvalue(enroll_date_res, 0, 0), 1);
+    ctx->gpa = atof(PQgetvalue(enroll_date_res, 0, 1));
+    PQclear(enroll_date_res);
+
+    //Find major(s) for this student
+    sprintf(student_buffer, "select sm.major_id from registry.student_major sm where sm.student_id=%d;", student_id);
+    PGresult *maj_res = traced_exec(conn, student_buffer);
+    if (PQresultStatus(maj_res) != PGRES_TUPLES_OK)
     {
-        buffer[i] = enroll_date[start];
-        i++;
+        free(student_buffer);
+        exit_nicely(conn, "Getting majors for student");
     }
 
-    return atoi(buffer);
-}
-
+    int NUM_MAJ = PQntuples(maj_res);
+    if (NUM_MAJ > 10)
+        NUM_MAJ = 10;
+    if (DEBUG)
+        fprintf(f, "Student %d has %d majors\n", student_id, NUM_MAJ);
 
-int check_prereq(PGconn *conn, int course, int *prereqlist)
-{
-    char *prereq_buffer = (char *) malloc (sizeof(char) * 1024);
-    sprintf(prereq_buffer, "select p.course_id from registry.course c join registry.prerequisite p on c.id=p.course_id where c.id=%d", course);
-    PGresult *prereq_res = PQexec(conn, prereq_buffer);
+    int majoriterate;
+    for (majoriterate = 0; majoriterate < NUM_MAJ; majoriterate++)
+    {
+        ctx->majors[majoriterate] = atoi(PQgetvalue(maj_res, majoriterate, 0));
+        if (DEBUG)
+            fprintf(f, "\tStudents major(s) are: %d\n", ctx->majors[majoriterate]);
+    }
+    ctx->num_majors = NUM_MAJ;
+    PQclear(maj_res);
 
-    if (PQresultStatus(prereq_res) != PGRES_TUPLES_OK)
+    //Everything already in enrollment, so "already taken" and the per term limit are answered from memory
+    sprintf(student_buffer, "select s.course_id, s.crn, s.year, s.quarter from registry.enrollment e join registry.section s on s.crn=e.crn where e.student_id=%d;", student_id);
+    PGresult *taken_res = traced_exec(conn, student_buffer);
+    if (PQresultStatus(taken_res) != PGRES_TUPLES_OK)
     {
-        free(prereq_buffer);
-        exit_nicely(conn, "Checking course prereqs");
+        free(student_buffer);
+        exit_nicely(conn, "Getting existing enrollment for student");
     }
 
-    int NUM_REQ = PQntuples(prereq_res);
-    if (NUM_REQ > 0)
+    num_ledger = 0;
+    int t;
+    for (t = 0; t < PQntuples(taken_res) && num_ledger < MAX_LEDGER; t++)
     {
-        int i;
-        for (i = 0; i < NUM_REQ; i++)
-        {
-            prereqlist[i] = atoi(PQgetvalue(prereq_res, i, 0));
-        }
-        PQclear(prereq_res);
-        return -1;
+        ledger[num_ledger].course = atoi(PQgetvalue(taken_res, t, 0));
+        ledger[num_ledger].crn = atoi(PQgetvalue(taken_res, t, 1));
+        ledger[num_ledger].year = atoi(PQgetvalue(taken_res, t, 2));
+        ledger[num_ledger].quarter = quarter_index(PQgetvalue(taken_res, t, 3));
+        num_ledger++;
     }
+    num_existing = num_ledger;
+    PQclear(taken_res);
 
-    PQclear(prereq_res);
-    return 0;
+    free(student_buffer);
+    return 1;
 }
 
-int already_enrolled(PGconn *conn, int student, int course)
+//one row per fact, tagged by kind, with the columns a kind doesn't use left null: the student, their majors, their
+//majors' courses, those courses' sections (with seats taken) and prerequisites, and the student's existing enrollment.
+//The capacity column is read through to_jsonb since it may not exist.
+const char *STUDENT_CONTEXT_QUERY =
+    "with maj as (select sm.major_id from registry.student_major sm where sm.student_id = $1), "
+    "mc as (select m.id as major_id, c.id as course_id from registry.major m "
+    "join registry.course c on c.department_id = m.department_id where m.id in (select major_id from maj)) "
+    "select 'student' as kind, null::int as major_id, null::int as major_course, null::int as course_id, null::int as crn, "
+    "null::text as quarter, null::int as year, null::int as capacity, null::bigint as taken, null::int as prereq_of, "
+    "null::int as prereq, null::int as taken_course, s.enrollment_date::text as enrollment_date, s.gpa::text as gpa "
+    "from registry.student s where s.id = $1 "
+    "union all select 'major', maj.major_id, null, null, null, null, null, null, null, null, null, null, null, null from maj "
+    "union all select 'major_course', mc.major_id, mc.course_id, null, null, null, null, null, null, null, null, null, null, null from mc "
+    "union all select 'section', null, null, s.course_id, s.crn, s.quarter, s.year, (to_jsonb(s) ->> 'capacity')::int, "
+    "(select count(*) from registry.enrollment e where e.crn = s.crn), null, null, null, null, null "
+    "from registry.section s where s.course_id in (select course_id from mc) "
+    "union all select 'prerequisite', null, null, null, null, null, null, null, null, p.course_id, "
+    "p." PREREQ_COLUMN "::int, null, null, null "
+    "from registry.prerequisite p where p.course_id in (select course_id from mc) "
+    "union all select 'enrolled', null, null, null, s.crn, s.quarter, s.year, null, null, null, null, s.course_id, null, null "
+    "from registry.enrollment e join registry.section s on s.crn = e.crn where e.student_id = $1 "
+    "order by kind, major_id, major_course, course_id, prereq_of, year, crn;";
+
+//fetch_student for a targeted run: one round trip, and the catalog and seat counts rebuilt from just this student's slice
+int fetch_student_context(PGconn *conn, FILE *f, int student_id, struct student_context *ctx)
 {
-    char *buffer = (char *) malloc (sizeof(char) * 1024);
-    sprintf(buffer, "select e.crn from registry.enrollment e join registry.section s on e.crn=s.crn join registry.course c on s.course_id=c.id where e.student_id =%d and c.id=%d;", student, course);
-    PGresult *res = PQexec(conn, buffer);
+    char id_param[32];
+    sprintf(id_param, "%d", student_id);
+    const char *params[1] = { id_param };
 
+    PGresult *res = traced_exec_params(conn, STUDENT_CONTEXT_QUERY, 1, NULL, params, NULL, NULL, 0);
     if (PQresultStatus(res) != PGRES_TUPLES_OK)
+        exit_nicely(conn, "Getting context for student");
+
+    int kind_col = PQfnumber(res, "kind");
+    int major_col = PQfnumber(res, "major_id");
+    int crn_col = PQfnumber(res, "crn");
+    int quarter_col = PQfnumber(res, "quarter");
+    int year_col = PQfnumber(res, "year");
+    int taken_col = PQfnumber(res, "taken");
+    int taken_course_col = PQfnumber(res, "taken_course");
+    int date_col = PQfnumber(res, "enrollment_date");
+    int gpa_col = PQfnumber(res, "gpa");
+
+    int found = 0;
+    ctx->num_majors = 0;
+    num_ledger = 0;
+
+    int r;
+    for (r = 0; r < PQntuples(res); r++)
     {
-        free(buffer);
-        exit_nicely(conn, "Checking if already enrolled");
+        char *kind = PQgetvalue(res, r, kind_col);
+        if (strcmp(kind, "student") == 0)
+        {
+            found = 1;
+            ctx->enroll_year = get_first_term(PQgetvalue(res, r, date_col), 0);
+            ctx->enroll_term = get_first_term(PQgetvalue(res, r, date_col), 1);
+            ctx->gpa = atof(PQgetvalue(res, r, gpa_col));
+        }
+        else if (strcmp(kind, "major") == 0 && ctx->num_majors < 10)
+            ctx->majors[ctx->num_majors++] = atoi(PQgetvalue(res, r, major_col));
+        else if (strcmp(kind, "enrolled") == 0 && num_ledger < MAX_LEDGER)
+        {
+            ledger[num_ledger].course = atoi(PQgetvalue(res, r, taken_course_col));
+            ledger[num_ledger].crn = atoi(PQgetvalue(res, r, crn_col));
+            ledger[num_ledger].year = atoi(PQgetvalue(res, r, year_col));
+            ledger[num_ledger].quarter = quarter_index(PQgetvalue(res, r, quarter_col));
+            num_ledger++;
+        }
     }
+    num_existing = num_ledger;
 
-    if (PQntuples(res) < 1)
+    if (!found)
     {
         PQclear(res);
         return 0;
     }
 
+    //the previous student's slice is no use to this one
+    catalog_close(&catalog);
+    catalog_build(conn, &catalog, 0, res, major_col, PQfnumber(res, "major_course"), res, PQfnumber(res, "course_id"),
+                  res, PQfnumber(res, "prereq_of"), PQfnumber(res, "prereq"));
+
+    //section rows come back in the order catalog_build laid them out
+    free(seats_taken);
+    seats_taken = (int32_t *) calloc(catalog.hdr->num_sections + 1, sizeof(int32_t));
+    int k = 0;
+    for (r = 0; r < PQntuples(res); r++)
+    {
+        if (!PQgetisnull(res, r, taken_col))
+            seats_taken[k++] = atoi(PQgetvalue(res, r, taken_col));
+    }
     PQclear(res);
-    return -1;
+
+    if (DEBUG)
+        fprintf(f, "Student %d has %d majors, %d candidate sections, %d enrollments\n", student_id, ctx->num_majors,
+                catalog.hdr->num_sections, num_existing);
+    return 1;
 }
 
-int rand_lim(int limit) 
+int run_coordinator(PGconn *conn, FILE *f, int range_size)
 {
-    //return a random number between 0 and limit inclusive
+    //the work table lives next to the registry so every worker, on any machine, sees the same queue
+    PGresult *res = traced_exec(conn, "create table if not exists registry.enrollment_work ("
+                                 "range_id serial primary key, "
+                                 "generator text not null default 'embedded_enrollment', "
+                                 "first_student int not null, "
+                                 "last_student int not null, "
+                                 "state text not null default 'pending', "
+                                 "worker text, "
+                                 "lease_until timestamptz, "
+                                 "attempts int not null default 0);");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        exit_nicely(conn, "Creating work table");
+    PQclear(res);
 
-    int divisor = RAND_MAX/(limit+1);
-    int retval;
+    //a queue made before generators shared it only ever held the major generator's ranges
+    res = traced_exec(conn, "alter table registry.enrollment_work add column if not exists generator text not null default 'embedded_enrollment';");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        exit_nicely(conn, "Adding generator to work table");
+    PQclear(res);
 
-    do { 
-        retval = rand() / divisor;
-    } while (retval > limit);
+    const char *generator_params[1] = { POLICY_NAME };
+    res = traced_exec_params(conn, "select count(*) from registry.enrollment_work where generator = $1 and state <> 'done';",
+                             1, NULL, generator_params, NULL, NULL, 0);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+        exit_nicely(conn, "Checking for unfinished work");
 
-    if (retval > 0)
-        return retval -1;
-    else
-        return retval;
+    int unfinished = atoi(PQgetvalue(res, 0, 0));
+    PQclear(res);
+    if (unfinished > 0)
+    {
+        fprintf(stderr, "%d ranges from a previous run are not done yet, not reseeding\n", unfinished);
+        return -1;
+    }
+
+    //seeded over the actual id span, so gaps in the student ids only make some ranges lighter
+    char *seed_buffer = (char *) malloc (sizeof(char) * 1024);
+    sprintf(seed_buffer, "insert into registry.enrollment_work (generator, first_student, last_student) "
+                         "select $1, lo, lo + %d - 1 from generate_series((select min(id) from registry.student), "
+                         "(select max(id) from registry.student), %d) lo;", range_size, range_size);
+    res = traced_exec_params(conn, seed_buffer, 1, NULL, generator_params, NULL, NULL, 0);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+    {
+        free(seed_buffer);
+        exit_nicely(conn, "Seeding work ranges");
+    }
+
+    fprintf(stderr, "Seeded %s ranges of %d students\n", PQcmdTuples(res), range_size);
+    if (DEBUG)
+        fprintf(f, "Coordinator seeded %s ranges of %d students\n", PQcmdTuples(res), range_size);
+
+    free(seed_buffer);
+    PQclear(res);
+    return 0;
+}
+
+int run_worker(PGconn *conn, FILE *f, int lease_secs)
+{
+    char worker_name[300];
+    char host[256];
+    if (gethostname(host, sizeof(host)) != 0)
+        strcpy(host, "unknown");
+    host[sizeof(host) - 1] = '\0';
+    sprintf(worker_name, "%s:%d", host, (int) getpid());
+
+    char lease_param[32];
+    sprintf(lease_param, "%d seconds", lease_secs);
+    const char *claim_params[3] = { worker_name, lease_param, POLICY_NAME };
+
+    //the range transaction's writes are invisible until it commits, so renewals go through their own connection
+    PGconn *lease_conn = PQconnectdb(conn_info);
+    if (PQstatus(lease_conn) != CONNECTION_OK)
+    {
+        PQfinish(lease_conn);
+        exit_nicely(conn, "Opening lease connection");
+    }
+
+    int ranges_done = 0;
+    jmp_buf range_jmp;
+
+    while (1)
+    {
+        //claim the first range nobody holds, or whose holder let the lease run out
+        PGresult *res = traced_exec_params(conn,
+                "update registry.enrollment_work w set state = 'claimed', worker = $1, "
+                "lease_until = now() + $2::interval, attempts = w.attempts + 1 "
+                "where w.range_id = (select range_id from registry.enrollment_work "
+                "where generator = $3 and (state = 'pending' or (state = 'claimed' and lease_until < now())) "
+                "order by range_id limit 1 for update skip locked) "
+                "returning w.range_id, w.first_student, w.last_student, w.attempts;",
+                3, NULL, claim_params, NULL, NULL, 0);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK)
+            exit_nicely(conn, "Claiming work range");
+
+        if (PQntuples(res) < 1)
+        {
+            PQclear(res);
+            break;
+        }
+
+        char range_id[32];
+        strcpy(range_id, PQgetvalue(res, 0, 0));
+        int first_student = atoi(PQgetvalue(res, 0, 1));
+        int last_student = atoi(PQgetvalue(res, 0, 2));
+        int attempts = atoi(PQgetvalue(res, 0, 3));
+        PQclear(res);
+
+        const char *range_params[3] = { range_id, worker_name, POLICY_NAME };
+        const char *renew_params[4] = { range_id, worker_name, POLICY_NAME, lease_param };
+
+        if (DEBUG)
+            fprintf(f, "Worker %s claimed range %s (%d - %d), attempt %d\n", worker_name, range_id, first_student, last_student, attempts);
+
+        if (attempts > MAX_RANGE_ATTEMPTS)
+        {
+            //this range keeps failing, park it for a human instead of bouncing it between workers forever
+            res = traced_exec_params(conn, "update registry.enrollment_work set state = 'failed', lease_until = null "
+                                     "where range_id = $1 and worker = $2 and generator = $3;", 3, NULL, range_params, NULL, NULL, 0);
+            PQclear(res);
+            fprintf(stderr, "Range %s failed %d times, marked failed\n", range_id, MAX_RANGE_ATTEMPTS);
+            continue;
+        }
+
+        if (setjmp(range_jmp) == 0)
+        {
+            worker_jmp = &range_jmp;
+
+            //the whole range is one transaction, so dying mid-range leaves nothing behind
+            res = traced_exec(conn, "begin;");
+            if (PQresultStatus(res) != PGRES_COMMAND_OK)
+                exit_nicely(conn, "Starting range transaction");
+            PQclear(res);
+
+            time_t renewed = time(NULL);
+            int i;
+            for (i = first_student; i <= last_student; i++)
+            {
+                generate_student(conn, f, i);
+
+                if (time(NULL) - renewed >= lease_secs / 3)
+                {
+                    //someone else holds the range now, the done check below throws this work away
+                    if (!renew_lease(lease_conn, renew_params))
+                        break;
+                    renewed = time(NULL);
+                }
+            }
+
+            //only mark done if the claim is still ours; if the lease ran out and someone else took it, drop this work
+            res = traced_exec_params(conn, "update registry.enrollment_work set state = 'done', lease_until = null "
+                                     "where range_id = $1 and worker = $2 and generator = $3 and state = 'claimed';",
+                               3, NULL, range_params, NULL, NULL, 0);
+            if (PQresultStatus(res) != PGRES_COMMAND_OK)
+                exit_nicely(conn, "Marking range done");
+
+            if (strcmp(PQcmdTuples(res), "1") != 0)
+            {
+                PQclear(res);
+                res = traced_exec(conn, "rollback;");
+                PQclear(res);
+                worker_jmp = NULL;
+                journal_discard();
+                load_seats(conn);
+                fprintf(stderr, "Lost the claim on range %s, discarded its work\n", range_id);
+                continue;
+            }
+            PQclear(res);
+
+            res = traced_exec(conn, "commit;");
+            if (PQresultStatus(res) != PGRES_COMMAND_OK)
+                exit_nicely(conn, "Committing range");
+            PQclear(res);
+            journal_commit();
+
+            worker_jmp = NULL;
+            ranges_done++;
+        }
+        else
+        {
+            //something failed inside the range: throw away its writes and hand it back
+            worker_jmp = NULL;
+            if (PQstatus(conn) != CONNECTION_OK)
+            {
+                fprintf(stderr, "Lost connection to DB, range %s will be reclaimed after its lease\n", range_id);
+                PQfinish(lease_conn);
+                return -1;
+            }
+
+            res = traced_exec(conn, "rollback;");
+            PQclear(res);
+            journal_discard();
+
+            //the seats this range claimed were rolled back with it
+            load_seats(conn);
+
+            res = traced_exec_params(conn, "update registry.enrollment_work set state = 'pending', worker = null, lease_until = null "
+                                     "where range_id = $1 and worker = $2 and generator = $3;", 3, NULL, range_params, NULL, NULL, 0);
+            PQclear(res);
+        }
+    }
+
+    PQfinish(lease_conn);
+    fprintf(stderr, "Worker %s finished %d ranges, no work left\n", worker_name, ranges_done);
+    return 0;
+}
+
+//pushes a claimed range's lease out again; 0 when the claim is no longer this worker's
+int renew_lease(PGconn *lease_conn, const char *const *renew_params)
+{
+    PGresult *res = traced_exec_params(lease_conn, "update registry.enrollment_work set lease_until = now() + $4::interval "
+                                       "where range_id = $1 and worker = $2 and generator = $3 and state = 'claimed';",
+                                       4, NULL, renew_params, NULL, NULL, 0);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+    {
+        //a lease that can't be renewed still runs its course, the range just has to finish in time
+        fprintf(stderr, "Renewing lease on range %s: %s", renew_params[0], PQerrorMessage(lease_conn));
+        PQclear(res);
+        return 1;
+    }
+
+    int held = strcmp(PQcmdTuples(res), "1") == 0;
+    PQclear(res);
+    return held;
+}
+
+int get_first_term(char *enroll_date, int year_or_term)
+{
+    //parse enroll_date and return
+    char *buffer = (char *) calloc(20, sizeof(char));
+    int start, finish;
+
+    if (year_or_term == 0) //parse for year
+    {
+        start = 0;
+        finish = 3;
+    }
+    else //parse for month
+    {
+        start = 5;
+        finish = 6;
+    }
+    int i = 0;
+    for (start; start <= finish; start++)
+    {
+        buffer[i] = enroll_date[start];
+        i++;
+    }
+
+    int value = atoi(buffer);
+    free(buffer);
+    return value;
+}
+
+
+void stats_count_term(int year, int quarter)
+{
+    //there are only a few dozen terms, a linear scan is fine
+    int t;
+    for (t = 0; t < stats.num_terms; t++)
+    {
+        if (stats.terms[t].year == year && stats.terms[t].quarter == quarter)
+        {
+            stats.terms[t].count++;
+            return;
+        }
+    }
+
+    if (stats.num_terms == stats.cap_terms)
+    {
+        stats.cap_terms = stats.cap_terms ? stats.cap_terms * 2 : 32;
+        stats.terms = (struct term_count *) realloc(stats.terms, sizeof(struct term_count) * stats.cap_terms);
+    }
+
+    struct term_count *term = &stats.terms[stats.num_terms++];
+    term->year = year;
+    term->quarter = quarter;
+    term->count = 1;
+}
+
+void stats_count_section(int crn)
+{
+    //keep the table at most half full
+    if ((stats.num_sections + 1) * 2 > stats.cap_sections)
+    {
+        struct crn_count *old = stats.sections;
+        int old_cap = stats.cap_sections;
+        int k;
+
+        stats.cap_sections = old_cap ? old_cap * 2 : 1024;
+        stats.sections = (struct crn_count *) calloc(stats.cap_sections, sizeof(struct crn_count));
+        for (k = 0; k < old_cap; k++)
+        {
+            if (old[k].count == 0)
+                continue;
+            unsigned int h = ((unsigned int) old[k].crn * 2654435761u) & (stats.cap_sections - 1);
+            while (stats.sections[h].count)
+                h = (h + 1) & (stats.cap_sections - 1);
+            stats.sections[h] = old[k];
+        }
+        free(old);
+    }
+
+    unsigned int h = ((unsigned int) crn * 2654435761u) & (stats.cap_sections - 1);
+    while (stats.sections[h].count && stats.sections[h].crn != crn)
+        h = (h + 1) & (stats.cap_sections - 1);
+
+    if (stats.sections[h].count == 0)
+    {
+        stats.sections[h].crn = crn;
+        stats.num_sections++;
+    }
+    stats.sections[h].count++;
+}
+
+void reset_stats(void)
+{
+    free(stats.terms);
+    free(stats.sections);
+    memset(&stats, 0, sizeof(stats));
+}
+
+void stats_finish_student(double gpa, int num_planned)
+{
+    stats.students++;
+    stats.enrollments += num_planned;
+    stats.per_student[num_planned < STATS_MAX_PER_STUDENT ? num_planned : STATS_MAX_PER_STUDENT]++;
+
+    if (num_planned == 0)
+        return;
+
+    //grade what was planned exactly like embedded_enrollment_grades does
+    double points = 0;
+    int p;
+    for (p = 0; p < num_planned; p++)
+    {
+        char *grade = policy_grade(gpa, &grade_seed);
+        stats.grades[grade_index(grade)]++;
+        points += grade_point(grade);
+    }
+
+    double sim_gpa = points / num_planned;
+    stats.graded_students++;
+    stats.target_gpa_sum += gpa;
+    stats.sim_gpa_sum += sim_gpa;
+    stats.gpa_abs_err_sum += sim_gpa > gpa ? sim_gpa - gpa : gpa - sim_gpa;
+}
+
+int compare_terms(const void *a, const void *b)
+{
+    const struct term_count *ta = (const struct term_count *) a;
+    const struct term_count *tb = (const struct term_count *) b;
+
+    if (ta->year != tb->year)
+        return ta->year - tb->year;
+    return ta->quarter - tb->quarter;
+}
+
+void print_dry_run_stats(PGconn *conn, FILE *out)
+{
+    int k;
+
+    fprintf(out, "DRY RUN: nothing was written\n\n");
+    fprintf(out, "Students: %ld, planned enrollments: %ld (%.2f per student)\n", stats.students, stats.enrollments,
+           stats.students ? (double) stats.enrollments / stats.students : 0.0);
+    fprintf(out, "Students left with no enrollment: %ld\n\n", stats.per_student[0]);
+
+    fprintf(out, "Enrollments per student:\n");
+    for (k = 0; k <= STATS_MAX_PER_STUDENT; k++)
+    {
+        if (stats.per_student[k])
+            fprintf(out, "  %3d%s %ld\n", k, k == STATS_MAX_PER_STUDENT ? "+" : " ", stats.per_student[k]);
+    }
+
+    fprintf(out, "\nEnrollments per term:\n");
+    qsort(stats.terms, stats.num_terms, sizeof(struct term_count), compare_terms);
+    for (k = 0; k < stats.num_terms; k++)
+        fprintf(out, "  %-6s %d  %ld\n", quarter_names[stats.terms[k].quarter], stats.terms[k].year, stats.terms[k].count);
+
+    //sections nobody got planned into are not in the table, count them from the catalog
+    long total_sections = 0;
+    PGresult *res = traced_exec(conn, "select count(*) from registry.section;");
+    if (PQresultStatus(res) == PGRES_TUPLES_OK)
+        total_sections = atol(PQgetvalue(res, 0, 0));
+    PQclear(res);
+
+    long max_fill = 0;
+    for (k = 0; k < stats.cap_sections; k++)
+    {
+        if (stats.sections[k].count > max_fill)
+            max_fill = stats.sections[k].count;
+    }
+
+    int num_buckets = max_fill / STATS_FILL_BUCKET + 1;
+    long *fill = (long *) calloc(num_buckets, sizeof(long));
+    for (k = 0; k < stats.cap_sections; k++)
+    {
+        if (stats.sections[k].count)
+            fill[stats.sections[k].count / STATS_FILL_BUCKET]++;
+    }
+
+    fprintf(out, "\nSection fill (new students per section):\n");
+    if (total_sections >= stats.num_sections)
+        fprintf(out, "  %7s  %ld\n", "0", total_sections - stats.num_sections);
+    for (k = 0; k < num_buckets; k++)
+    {
+        if (fill[k])
+            fprintf(out, "  %3d-%-3d  %ld\n", k == 0 ? 1 : k * STATS_FILL_BUCKET, (k + 1) * STATS_FILL_BUCKET - 1, fill[k]);
+    }
+    free(fill);
+
+    fprintf(out, "\nGrade distribution:\n");
+    for (k = 0; k < NUM_GRADES; k++)
+        fprintf(out, "  %-2s  %ld\n", grade_letters[k], stats.grades[k]);
+    if (stats.graded_students)
+        fprintf(out, "Target gpa %.2f, generated gpa %.2f, mean absolute difference %.2f\n",
+               stats.target_gpa_sum / stats.graded_students, stats.sim_gpa_sum / stats.graded_students,
+               stats.gpa_abs_err_sum / stats.graded_students);
+
+    fprintf(out, "\nCandidate courses rejected:\n");
+    fprintf(out, "  random threshold      %ld\n", stats.rejected_threshold);
+    fprintf(out, "  already enrolled      %ld\n", stats.rejected_enrolled);
+    fprintf(out, "  no sections           %ld\n", stats.rejected_no_sections);
+    fprintf(out, "  term too early        %ld\n", stats.rejected_too_early);
+    fprintf(out, "  term full             %ld\n", stats.rejected_term_full);
+    fprintf(out, "  section full          %ld\n", stats.rejected_section_full);
+    fprintf(out, "  prerequisite missing  %ld\n", stats.rejected_prereq);
+}
+
+int ledger_has_course(int course)
+{
+    int k;
+    for (k = 0; k < num_ledger; k++)
+    {
+        if (ledger[k].course == course)
+            return 1;
+    }
+    return 0;
+}
+
+int ledger_in_term(int year, int quarter)
+{
+    int k;
+    int count = 0;
+    for (k = 0; k < num_ledger; k++)
+    {
+        if (ledger[k].year == year && ledger[k].quarter == quarter)
+            count++;
+    }
+    return count;
+}
+
+uint64_t catalog_checksum(PGconn *conn)
+{
+    //row counts and max ids move whenever somebody adds or removes catalog rows, at the cost of one cheap query
+    PGresult *res = traced_exec(conn, "select (select count(*) from registry.major), (select coalesce(max(id), 0) from registry.major), "
+                                 "(select count(*) from registry.department), (select coalesce(max(id), 0) from registry.department), "
+                                 "(select count(*) from registry.course), (select coalesce(max(id), 0) from registry.course), "
+                                 "(select count(*) from registry.section), (select coalesce(max(crn), 0) from registry.section), "
+                                 "(select count(*) from registry.prerequisite), (select coalesce(max(course_id), 0) from registry.prerequisite), "
+                                 "(select count(*) from information_schema.columns where table_schema = 'registry' and table_name = 'section' and column_name = 'capacity');");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+        exit_nicely(conn, "Checksumming catalog tables");
+
+    //FNV-1a over the values, with the layout version mixed in so a format change also invalidates
+    uint64_t hash = 14695981039346656037ULL ^ CATALOG_VERSION;
+    int col;
+    for (col = 0; col < PQnfields(res); col++)
+    {
+        char *value = PQgetvalue(res, 0, col);
+        while (1)
+        {
+            hash = (hash ^ (unsigned char) *value) * 1099511628211ULL;
+            if (*value == '\0')
+                break;
+            value++;
+        }
+    }
+
+    PQclear(res);
+    return hash;
+}
+
+void catalog_attach(struct catalog *cat, char *base)
+{
+    //every array is found from offsets in the header, so the same bytes work malloc'd or mapped anywhere
+    cat->base = base;
+    cat->hdr = (struct catalog_header *) base;
+    cat->major_course_start = (int32_t *) (base + cat->hdr->major_course_start);
+    cat->major_courses = (int32_t *) (base + cat->hdr->major_courses);
+    cat->course_section_start = (int32_t *) (base + cat->hdr->course_section_start);
+    cat->sections = (struct catalog_section *) (base + cat->hdr->sections);
+    cat->course_prereq_start = (int32_t *) (base + cat->hdr->course_prereq_start);
+    cat->prereqs = (int32_t *) (base + cat->hdr->prereqs);
+}
+
+int catalog_load_file(struct catalog *cat, const char *path, uint64_t checksum)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(struct catalog_header))
+    {
+        close(fd);
+        return -1;
+    }
+
+    char *base = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return -1;
+
+    struct catalog_header *hdr = (struct catalog_header *) base;
+    if (memcmp(hdr->magic, CATALOG_MAGIC, sizeof(hdr->magic)) != 0 || hdr->version != CATALOG_VERSION ||
+        hdr->size != (uint64_t) st.st_size || hdr->checksum != checksum)
+    {
+        munmap(base, st.st_size);
+        return -1;
+    }
+
+    catalog_attach(cat, base);
+    cat->size = st.st_size;
+    cat->mapped = 1;
+    return 0;
+}
+
+//turns (key, value) rows into a start array indexed by key plus one values array; returns the values
+int32_t *catalog_fill_index(int32_t *start, int max_key, PGresult *res, int key_col, int value_col, int32_t *values)
+{
+    int r;
+    int rows = PQntuples(res);
+
+    for (r = 0; r < rows; r++)
+    {
+        if (PQgetisnull(res, r, key_col) || PQgetisnull(res, r, value_col))
+            continue;
+        start[atoi(PQgetvalue(res, r, key_col)) + 1]++;
+    }
+    for (r = 0; r <= max_key; r++)
+        start[r + 1] += start[r];
+
+    //the queries come back ordered by key, so appending in row order fills each key's slice in turn
+    int fill = 0;
+    for (r = 0; r < rows; r++)
+    {
+        if (PQgetisnull(res, r, key_col) || PQgetisnull(res, r, value_col))
+            continue;
+        values[fill++] = atoi(PQgetvalue(res, r, value_col));
+    }
+    return values;
+}
+
+int max_column(PGresult *res, int col, int max)
+{
+    int r;
+    for (r = 0; r < PQntuples(res); r++)
+    {
+        if (!PQgetisnull(res, r, col) && atoi(PQgetvalue(res, r, col)) > max)
+            max = atoi(PQgetvalue(res, r, col));
+    }
+    return max;
+}
+
+void catalog_load_db(PGconn *conn, struct catalog *cat, uint64_t checksum)
+{
+    PGresult *maj_res = traced_exec(conn, "select m.id, c.id from registry.major m join registry.department d on m.department_id=d.id "
+                                     "join registry.course c on d.id=c.department_id order by m.id, c.id;");
+    if (PQresultStatus(maj_res) != PGRES_TUPLES_OK)
+        exit_nicely(conn, "Loading courses for majors");
+
+    //capacity is optional, so take the columns by name
+    PGresult *sec_res = traced_exec(conn, "select s.* from registry.section s "
+                                     "where s.course_id is not null order by s.course_id, s.year, s.crn;");
+    if (PQresultStatus(sec_res) != PGRES_TUPLES_OK)
+        exit_nicely(conn, "Loading sections");
+
+    PGresult *pre_res = traced_exec(conn, "select p.course_id, p." PREREQ_COLUMN " from registry.prerequisite p order by p.course_id;");
+    if (PQresultStatus(pre_res) != PGRES_TUPLES_OK)
+        exit_nicely(conn, "Loading prerequisites");
+
+    catalog_build(conn, cat, checksum, maj_res, 0, 1, sec_res, PQfnumber(sec_res, "course_id"), pre_res, 0, 1);
+
+    PQclear(maj_res);
+    PQclear(sec_res);
+    PQclear(pre_res);
+}
+
+int count_rows(PGresult *res, int col)
+{
+    int r;
+    int count = 0;
+    for (r = 0; r < PQntuples(res); r++)
+    {
+        if (!PQgetisnull(res, r, col))
+            count++;
+    }
+    return count;
+}
+
+//lays out a catalog from (major, course) rows, section rows and (course, required course) rows, each ordered by
+//its first key; rows with a null key are skipped, so one result with a kind of row per line can serve as all three
+void catalog_build(PGconn *conn, struct catalog *cat, uint64_t checksum, PGresult *maj_res, int maj_major_col, int maj_course_col,
+                   PGresult *sec_res, int sec_course_col, PGresult *pre_res, int pre_course_col, int pre_req_col)
+{
+    int sec_crn_col = PQfnumber(sec_res, "crn");
+    int sec_quarter_col = PQfnumber(sec_res, "quarter");
+    int sec_year_col = PQfnumber(sec_res, "year");
+    int sec_capacity_col = PQfnumber(sec_res, "capacity");
+
+    int max_major = max_column(maj_res, maj_major_col, 0);
+    int max_course = max_column(maj_res, maj_course_col, 0);
+    max_course = max_column(sec_res, sec_course_col, max_course);
+    max_course = max_column(pre_res, pre_course_col, max_course);
+    max_course = max_column(pre_res, pre_req_col, max_course);
+
+    int num_major_courses = count_rows(maj_res, maj_course_col);
+    int num_sections = count_rows(sec_res, sec_course_col);
+    int num_prereqs = count_rows(pre_res, pre_req_col);
+
+    //lay the arrays out back to back after the header
+    uint64_t size = sizeof(struct catalog_header);
+    uint64_t off_major_course_start = size;
+    size += sizeof(int32_t) * (max_major + 2);
+    uint64_t off_major_courses = size;
+    size += sizeof(int32_t) * num_major_courses;
+    uint64_t off_course_section_start = size;
+    size += sizeof(int32_t) * (max_course + 2);
+    uint64_t off_sections = size;
+    size += sizeof(struct catalog_section) * num_sections;
+    uint64_t off_course_prereq_start = size;
+    size += sizeof(int32_t) * (max_course + 2);
+    uint64_t off_prereqs = size;
+    size += sizeof(int32_t) * num_prereqs;
+
+    char *base = (char *) calloc(1, size);
+    if (base == NULL)
+        exit_nicely(conn, "Allocating catalog");
+
+    struct catalog_header *hdr = (struct catalog_header *) base;
+    memcpy(hdr->magic, CATALOG_MAGIC, sizeof(hdr->magic));
+    hdr->version = CATALOG_VERSION;
+    hdr->size = size;
+    hdr->checksum = checksum;
+    hdr->max_major = max_major;
+    hdr->max_course = max_course;
+    hdr->num_major_courses = num_major_courses;
+    hdr->num_sections = num_sections;
+    hdr->num_prereqs = num_prereqs;
+    hdr->major_course_start = off_major_course_start;
+    hdr->major_courses = off_major_courses;
+    hdr->course_section_start = off_course_section_start;
+    hdr->sections = off_sections;
+    hdr->course_prereq_start = off_course_prereq_start;
+    hdr->prereqs = off_prereqs;
+    catalog_attach(cat, base);
+    cat->size = size;
+    cat->mapped = 0;
+
+    catalog_fill_index(cat->major_course_start, max_major, maj_res, maj_major_col, maj_course_col, cat->major_courses);
+    catalog_fill_index(cat->course_prereq_start, max_course, pre_res, pre_course_col, pre_req_col, cat->prereqs);
+
+    //sections carry more than one value, so fill them by hand the same way
+    int r;
+    for (r = 0; r < PQntuples(sec_res); r++)
+    {
+        if (!PQgetisnull(sec_res, r, sec_course_col))
+            cat->course_section_start[atoi(PQgetvalue(sec_res, r, sec_course_col)) + 1]++;
+    }
+    for (r = 0; r <= max_course; r++)
+        cat->course_section_start[r + 1] += cat->course_section_start[r];
+
+    int fill = 0;
+    for (r = 0; r < PQntuples(sec_res); r++)
+    {
+        if (PQgetisnull(sec_res, r, sec_course_col))
+            continue;
+        cat->sections[fill].crn = atoi(PQgetvalue(sec_res, r, sec_crn_col));
+        cat->sections[fill].quarter = quarter_index(PQgetvalue(sec_res, r, sec_quarter_col));
+        cat->sections[fill].year = atoi(PQgetvalue(sec_res, r, sec_year_col));
+        if (sec_capacity_col >= 0 && !PQgetisnull(sec_res, r, sec_capacity_col))
+            cat->sections[fill].capacity = atoi(PQgetvalue(sec_res, r, sec_capacity_col));
+        else
+            cat->sections[fill].capacity = DEFAULT_SECTION_CAPACITY;
+        fill++;
+    }
+}
+
+int catalog_save(struct catalog *cat, const char *path)
+{
+    //write next to the real file and rename, so a concurrent run never maps a half written cache
+    char tmp_path[1024];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d", path, (int) getpid());
+
+    FILE *out = fopen(tmp_path, "wb");
+    if (out == NULL)
+        return -1;
+
+    if (fwrite(cat->base, 1, cat->size, out) != cat->size)
+    {
+        fclose(out);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    if (fclose(out) != 0 || rename(tmp_path, path) != 0)
+    {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+void catalog_open(PGconn *conn, struct catalog *cat, FILE *f)
+{
+    const char *path = getenv("EE_CATALOG");
+    if (path == NULL)
+        path = CATALOG_FILE;
+
+    uint64_t checksum = catalog_checksum(conn);
+    if (catalog_load_file(cat, path, checksum) == 0)
+    {
+        if (DEBUG)
+            fprintf(f, "Catalog mapped from %s\n", path);
+        return;
+    }
+
+    catalog_load_db(conn, cat, checksum);
+    if (catalog_save(cat, path) != 0)
+        fprintf(stderr, "NOTE: could not write catalog cache %s, next run will load from the DB again\n", path);
+    if (DEBUG)
+        fprintf(f, "Catalog loaded from DB: %d sections, %d major courses, %d prerequisites\n",
+                cat->hdr->num_sections, cat->hdr->num_major_courses, cat->hdr->num_prereqs);
+}
+
+void catalog_close(struct catalog *cat)
+{
+    if (cat->base == NULL)
+        return;
+
+    if (cat->mapped)
+        munmap(cat->base, cat->size);
+    else
+        free(cat->base);
+    cat->base = NULL;
+
+    //the crn index points into this catalog's sections
+    if (cat == &catalog)
+    {
+        free(crn_order);
+        crn_order = NULL;
+    }
+}
+
+int32_t *catalog_major_courses(struct catalog *cat, int major, int *count)
+{
+    if (major < 0 || major > cat->hdr->max_major)
+    {
+        *count = 0;
+        return NULL;
+    }
+    *count = cat->major_course_start[major + 1] - cat->major_course_start[major];
+    return &cat->major_courses[cat->major_course_start[major]];
+}
+
+struct catalog_section *catalog_course_sections(struct catalog *cat, int course, int *count)
+{
+    if (course < 0 || course > cat->hdr->max_course)
+    {
+        *count = 0;
+        return NULL;
+    }
+    *count = cat->course_section_start[course + 1] - cat->course_section_start[course];
+    return &cat->sections[cat->course_section_start[course]];
+}
+
+int32_t *catalog_course_prereqs(struct catalog *cat, int course, int *count)
+{
+    if (course < 0 || course > cat->hdr->max_course)
+    {
+        *count = 0;
+        return NULL;
+    }
+    *count = cat->course_prereq_start[course + 1] - cat->course_prereq_start[course];
+    return &cat->prereqs[cat->course_prereq_start[course]];
+}
+
+int compare_crn_order(const void *a, const void *b)
+{
+    int32_t crn_a = catalog.sections[*(const int32_t *) a].crn;
+    int32_t crn_b = catalog.sections[*(const int32_t *) b].crn;
+
+    return (crn_a > crn_b) - (crn_a < crn_b);
+}
+
+int section_by_crn(int crn)
+{
+    int num_sections = catalog.hdr->num_sections;
+
+    if (crn_order == NULL)
+    {
+        int k;
+        crn_order = (int32_t *) malloc(sizeof(int32_t) * (num_sections + 1));
+        for (k = 0; k < num_sections; k++)
+            crn_order[k] = k;
+        qsort(crn_order, num_sections, sizeof(int32_t), compare_crn_order);
+    }
+
+    int lo = 0;
+    int hi = num_sections - 1;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        int mid_crn = catalog.sections[crn_order[mid]].crn;
+        if (mid_crn == crn)
+            return crn_order[mid];
+        if (mid_crn < crn)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
+void load_seats(PGconn *conn)
+{
+    //everybody already enrolled holds a seat
+    PGresult *res = traced_exec(conn, "select e.crn, count(*) from registry.enrollment e group by e.crn;");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+        exit_nicely(conn, "Counting taken seats");
+
+    memset(seats_taken, 0, sizeof(int32_t) * catalog.hdr->num_sections);
+    int r;
+    for (r = 0; r < PQntuples(res); r++)
+    {
+        int k = section_by_crn(atoi(PQgetvalue(res, r, 0)));
+        if (k >= 0)
+            seats_taken[k] = atoi(PQgetvalue(res, r, 1));
+    }
+    PQclear(res);
+}
+
+int claim_seat(struct catalog_section *section)
+{
+    int32_t *taken = &seats_taken[section - catalog.sections];
+    int32_t seen = __atomic_load_n(taken, __ATOMIC_RELAXED);
+
+    //lock free: retry only while somebody else moved the count under us and there is still room
+    while (seen < section->capacity)
+    {
+        if (__atomic_compare_exchange_n(taken, &seen, seen + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            return 1;
+    }
+    return 0;
+}
+
+void release_seat(struct catalog_section *section)
+{
+    __atomic_fetch_sub(&seats_taken[section - catalog.sections], 1, __ATOMIC_ACQ_REL);
+}
+
+//the section if a student who enrolled in enroll_year/enroll_term may take it, NULL otherwise
+struct catalog_section *section_fits(struct catalog_section *section, int enroll_year, int enroll_term)
+{
+    if (enroll_year > section->year ||
+        (enroll_year == section->year && enroll_term > quarter_last_month[section->quarter]))
+        return NULL;
+
+    if (ledger_in_term(section->year, section->quarter) > 3)
+        return NULL;
+
+    return section;
+}
+
+void student_add_course(int s, int course, int crn, int term)
+{
+    //slices are sized up front for every course the student could still get, so this always fits
+    int32_t at = students.ledger_start[s] + students.ledger_len[s];
+    if (at >= students.ledger_start[s + 1])
+        return;
+
+    ledger_cols.course[at] = course;
+    ledger_cols.crn[at] = crn;
+    ledger_cols.term[at] = term;
+    students.ledger_len[s]++;
+    students.taken_bits[(size_t) s * students.course_words + course / 64] |= 1ULL << (course % 64);
+}
+
+//1 if student s has the course, or (before_term >= 0) completed it in a term before before_term
+int student_has_course(int s, int course, int before_term)
+{
+    int32_t k;
+    int32_t end = students.ledger_start[s] + students.ledger_len[s];
+    for (k = students.ledger_start[s]; k < end; k++)
+    {
+        if (ledger_cols.course[k] == course && (before_term < 0 || ledger_cols.term[k] < before_term))
+            return 1;
+    }
+    return 0;
+}
+
+int student_in_term(int s, int term)
+{
+    int32_t k;
+    int32_t end = students.ledger_start[s] + students.ledger_len[s];
+    int count = 0;
+    for (k = students.ledger_start[s]; k < end; k++)
+    {
+        if (ledger_cols.term[k] == term)
+            count++;
+    }
+    return count;
+}
+
+//student s's next major id after after (-1 to start), or -1 when there are no more
+int next_major(int s, int after)
+{
+    uint64_t *mask = &students.major_mask[(size_t) s * students.mask_words];
+    int w = (after + 1) / 64;
+    if (w >= students.mask_words)
+        return -1;
+
+    //drop the bits at or below after in its word, then take the lowest bit left
+    uint64_t bits = mask[w] & (~0ULL << ((after + 1) % 64));
+    while (bits == 0)
+    {
+        if (++w >= students.mask_words)
+            return -1;
+        bits = mask[w];
+    }
+    return w * 64 + __builtin_ctzll(bits);
+}
+
+void load_students(PGconn *conn)
+{
+    PGresult *res = traced_exec(conn, "select coalesce(max(id), 0), count(*) from registry.student;");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+        exit_nicely(conn, "Getting student id range");
+    students.max_id = atoi(PQgetvalue(res, 0, 0));
+    int cap = atoi(PQgetvalue(res, 0, 1)) + 1;
+    PQclear(res);
+
+    students.index = (int32_t *) malloc(sizeof(int32_t) * (students.max_id + 1));
+    memset(students.index, 0xff, sizeof(int32_t) * (students.max_id + 1));
+    students.id = (int32_t *) malloc(sizeof(int32_t) * cap);
+    students.start_term = (int32_t *) malloc(sizeof(int32_t) * cap);
+    students.gpa = (int16_t *) malloc(sizeof(int16_t) * cap);
+    students.count = 0;
+
+    char *line;
+    res = traced_exec(conn, "copy (select id, to_char(enrollment_date, 'YYYY-MM-DD'), gpa from registry.student "
+                       "where enrollment_date is not null order by id) to stdout;");
+    if (PQresultStatus(res) != PGRES_COPY_OUT)
+        exit_nicely(conn, "Copying students");
+    PQclear(res);
+
+    while (PQgetCopyData(conn, &line, 0) > 0)
+    {
+        int id, year, month, day;
+        double gpa = 0;
+        //rows added since the count are left for the next run
+        if (sscanf(line, "%d\t%d-%d-%d\t%lf", &id, &year, &month, &day, &gpa) >= 4 && id >= 0 && id <= students.max_id &&
+            students.count < cap)
+        {
+            int s = students.count++;
+            students.id[s] = id;
+            students.start_term[s] = start_term_of(year, month);
+            students.gpa[s] = (int16_t) (gpa * 100 + 0.5);
+            students.index[id] = s;
+        }
+        PQfreemem(line);
+    }
+    res = PQgetResult(conn);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        exit_nicely(conn, "Copying students");
+    PQclear(res);
+
+    //one bit per major id
+    students.mask_words = catalog.hdr->max_major / 64 + 1;
+    students.major_mask = (uint64_t *) calloc((size_t) students.count * students.mask_words + 1, sizeof(uint64_t));
+
+    res = traced_exec(conn, "copy (select student_id, major_id from registry.student_major) to stdout;");
+    if (PQresultStatus(res) != PGRES_COPY_OUT)
+        exit_nicely(conn, "Copying student majors");
+    PQclear(res);
+
+    while (PQgetCopyData(conn, &line, 0) > 0)
+    {
+        int id, major;
+        if (sscanf(line, "%d\t%d", &id, &major) == 2 && id >= 0 && id <= students.max_id && students.index[id] >= 0 &&
+            major >= 0 && major <= catalog.hdr->max_major)
+        {
+            students.major_mask[(size_t) students.index[id] * students.mask_words + major / 64] |= 1ULL << (major % 64);
+        }
+        PQfreemem(line);
+    }
+    res = PQgetResult(conn);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        exit_nicely(conn, "Copying student majors");
+    PQclear(res);
+
+    //the mask becomes the majors the policy offers, so the simulation and the planners need not know about policies
+    int own[10], offered[10];
+    int s;
+    for (s = 0; s < students.count; s++)
+    {
+        int num_own = 0;
+        int major;
+        for (major = next_major(s, -1); major >= 0 && num_own < 10; major = next_major(s, major))
+            own[num_own++] = major;
+
+        int num_offered = policy_majors(own, num_own, offered, 10, catalog.hdr->max_major, NULL);
+        uint64_t *mask = &students.major_mask[(size_t) s * students.mask_words];
+        memset(mask, 0, sizeof(uint64_t) * students.mask_words);
+        int k;
+        for (k = 0; k < num_offered; k++)
+            mask[offered[k] / 64] |= 1ULL << (offered[k] % 64);
+    }
+
+    //existing enrollment is held aside until every student's ledger slice can be sized
+    long num_rows = 0;
+    long cap_rows = 1024;
+    int32_t *row_student = (int32_t *) malloc(sizeof(int32_t) * cap_rows);
+    int32_t *row_section = (int32_t *) malloc(sizeof(int32_t) * cap_rows);
+
+    res = traced_exec(conn, "copy (select student_id, crn from registry.enrollment) to stdout;");
+    if (PQresultStatus(res) != PGRES_COPY_OUT)
+        exit_nicely(conn, "Copying enrollment");
+    PQclear(res);
+
+    while (PQgetCopyData(conn, &line, 0) > 0)
+    {
+        int id, crn;
+        if (sscanf(line, "%d\t%d", &id, &crn) == 2 && id >= 0 && id <= students.max_id && students.index[id] >= 0)
+        {
+            int k = section_by_crn(crn);
+            if (k >= 0)
+            {
+                if (num_rows == cap_rows)
+                {
+                    cap_rows *= 2;
+                    row_student = (int32_t *) realloc(row_student, sizeof(int32_t) * cap_rows);
+                    row_section = (int32_t *) realloc(row_section, sizeof(int32_t) * cap_rows);
+                }
+                row_student[num_rows] = students.index[id];
+                row_section[num_rows] = k;
+                num_rows++;
+            }
+        }
+        PQfreemem(line);
+    }
+    res = PQgetResult(conn);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        exit_nicely(conn, "Copying enrollment");
+    PQclear(res);
+
+    //a slice holds what the student has plus every course of their majors, which bounds what a run can add
+    students.ledger_start = (int32_t *) calloc(students.count + 1, sizeof(int32_t));
+    students.ledger_len = (int32_t *) calloc(students.count + 1, sizeof(int32_t));
+    students.ledger_existing = (int32_t *) calloc(students.count + 1, sizeof(int32_t));
+
+    long r;
+    for (r = 0; r < num_rows; r++)
+        students.ledger_start[row_student[r] + 1]++;
+    for (s = 0; s < students.count; s++)
+    {
+        int major;
+        for (major = next_major(s, -1); major >= 0; major = next_major(s, major))
+        {
+            int NUM_COURSES;
+            catalog_major_courses(&catalog, major, &NUM_COURSES);
+            students.ledger_start[s + 1] += NUM_COURSES;
+        }
+    }
+    for (s = 0; s < students.count; s++)
+        students.ledger_start[s + 1] += students.ledger_start[s];
+
+    ledger_cols.cap = students.ledger_start[students.count];
+    ledger_cols.course = (int32_t *) malloc(sizeof(int32_t) * (ledger_cols.cap + 1));
+    ledger_cols.crn = (int32_t *) malloc(sizeof(int32_t) * (ledger_cols.cap + 1));
+    ledger_cols.term = (int32_t *) malloc(sizeof(int32_t) * (ledger_cols.cap + 1));
+
+    //one bit per course id; done_bits is filled in term by term as the simulation passes each term
+    students.course_words = catalog.hdr->max_course / 64 + 1;
+    students.taken_bits = (uint64_t *) calloc((size_t) students.count * students.course_words + 1, sizeof(uint64_t));
+    students.done_bits = (uint64_t *) calloc((size_t) students.count * students.course_words + 1, sizeof(uint64_t));
+
+    for (r = 0; r < num_rows; r++)
+    {
+        struct catalog_section *section = &catalog.sections[row_section[r]];
+        student_add_course(row_student[r], section_course(row_section[r]), section->crn,
+                           section->year * NUM_QUARTERS + section->quarter);
+    }
+    for (s = 0; s < students.count; s++)
+        students.ledger_existing[s] = students.ledger_len[s];
+
+    free(row_student);
+    free(row_section);
+}
+
+void free_students(void)
+{
+    free(students.id);
+    free(students.start_term);
+    free(students.gpa);
+    free(students.major_mask);
+    free(students.taken_bits);
+    free(students.done_bits);
+    free(students.ledger_start);
+    free(students.ledger_len);
+    free(students.ledger_existing);
+    free(students.index);
+    free(ledger_cols.course);
+    free(ledger_cols.crn);
+    free(ledger_cols.term);
+    memset(&students, 0, sizeof(students));
+    memset(&ledger_cols, 0, sizeof(ledger_cols));
+}
+
+//the course a catalog section belongs to, found from the per course section ranges
+int section_course(int k)
+{
+    int lo = 0;
+    int hi = catalog.hdr->max_course;
+
+    //largest course whose first section is at or before k
+    while (lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+        if (catalog.course_section_start[mid] <= k)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+int compare_term_sections(const void *a, const void *b)
+{
+    struct catalog_section *sa = &catalog.sections[*(const int32_t *) a];
+    struct catalog_section *sb = &catalog.sections[*(const int32_t *) b];
+    int term_a = sa->year * NUM_QUARTERS + sa->quarter;
+    int term_b = sb->year * NUM_QUARTERS + sb->quarter;
+
+    if (term_a != term_b)
+        return term_a - term_b;
+    return *(const int32_t *) a - *(const int32_t *) b;
+}
+
+//eligible = major & offered & ~taken, for n students whose rows of words are back to back in major, taken and out
+void eligible_scalar(const uint64_t *major, const uint64_t *taken, const uint64_t *offered, uint64_t *out, int words, int n)
+{
+    int b, w;
+    for (b = 0; b < n; b++)
+    {
+        for (w = 0; w < words; w++)
+            out[w] = major[w] & offered[w] & ~taken[w];
+        major += words;
+        taken += words;
+        out += words;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+//same as eligible_scalar, four words (256 courses) per instruction
+__attribute__((target("avx2")))
+void eligible_avx2(const uint64_t *major, const uint64_t *taken, const uint64_t *offered, uint64_t *out, int words, int n)
+{
+    int b, w;
+    for (b = 0; b < n; b++)
+    {
+        for (w = 0; w + 4 <= words; w += 4)
+        {
+            __m256i m = _mm256_loadu_si256((const __m256i *) (major + w));
+            __m256i o = _mm256_loadu_si256((const __m256i *) (offered + w));
+            __m256i t = _mm256_loadu_si256((const __m256i *) (taken + w));
+            _mm256_storeu_si256((__m256i *) (out + w), _mm256_andnot_si256(t, _mm256_and_si256(m, o)));
+        }
+        for (; w < words; w++)
+            out[w] = major[w] & offered[w] & ~taken[w];
+        major += words;
+        taken += words;
+        out += words;
+    }
+}
+#else
+void eligible_avx2(const uint64_t *major, const uint64_t *taken, const uint64_t *offered, uint64_t *out, int words, int n)
+{
+    eligible_scalar(major, taken, offered, out, words, n);
+}
+#endif
+
+void pick_eligible_kernel(FILE *f)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        eligible_kernel = eligible_avx2;
+#endif
+    if (DEBUG)
+        fprintf(f, "Eligibility kernel: %s\n", eligible_kernel == eligible_avx2 ? "avx2" : "scalar");
+}
+
+//1 if student s completed every prerequisite of course in a term before the one being simulated
+int prereqs_done(int s, int course)
+{
+    uint64_t *done = &students.done_bits[(size_t) s * students.course_words];
+    int NUM_REQ;
+    int32_t *prereq_list = catalog_course_prereqs(&catalog, course, &NUM_REQ);
+    int r;
+    for (r = 0; r < NUM_REQ; r++)
+    {
+        int req = prereq_list[r];
+        if (req < 0 || req > catalog.hdr->max_course || !(done[req / 64] & (1ULL << (req % 64))))
+            return 0;
+    }
+    return 1;
+}
+
+int compare_pending_done(const void *a, const void *b)
+{
+    return ((const struct pending_done *) a)->term - ((const struct pending_done *) b)->term;
+}
+
+int run_simulation(PGconn *conn, FILE *f)
+{
+    int num_sections = catalog.hdr->num_sections;
+    int max_course = catalog.hdr->max_course;
+    int k, s, w;
+
+    load_students(conn);
+    if (DEBUG)
+        fprintf(f, "Simulating %d students\n", students.count);
+    if (students.count == 0 || num_sections == 0)
+    {
+        free_students();
+        return 0;
+    }
+    pick_eligible_kernel(f);
+
+    //sections in term order; sorting by index within a term keeps each course's sections together
+    int32_t *term_order = (int32_t *) malloc(sizeof(int32_t) * num_sections);
+    for (k = 0; k < num_sections; k++)
+        term_order[k] = k;
+    qsort(term_order, num_sections, sizeof(int32_t), compare_term_sections);
+
+    //for the term being simulated: where each offered course's sections start in term_order, and how many
+    int32_t *offered_first = (int32_t *) malloc(sizeof(int32_t) * (max_course + 1));
+    int32_t *offered_count = (int32_t *) calloc(max_course + 1, sizeof(int32_t));
+
+    //the same catalog as bitsets over course ids: each major's courses, courses with prerequisites, and this term's offerings
+    int words = students.course_words;
+    uint64_t *major_bits = (uint64_t *) calloc((size_t) (catalog.hdr->max_major + 1) * words, sizeof(uint64_t));
+    uint64_t *prereq_bits = (uint64_t *) calloc(words, sizeof(uint64_t));
+    uint64_t *offered_bits = (uint64_t *) calloc(words, sizeof(uint64_t));
+    int major;
+    for (major = 0; major <= catalog.hdr->max_major; major++)
+    {
+        int NUM_COURSES;
+        int32_t *courses = catalog_major_courses(&catalog, major, &NUM_COURSES);
+        int c;
+        for (c = 0; c < NUM_COURSES; c++)
+        {
+            if (courses[c] >= 0 && courses[c] <= max_course)
+                major_bits[(size_t) major * words + courses[c] / 64] |= 1ULL << (courses[c] % 64);
+        }
+    }
+    for (k = 0; k <= max_course; k++)
+    {
+        if (catalog.course_prereq_start[k + 1] > catalog.course_prereq_start[k])
+            prereq_bits[k / 64] |= 1ULL << (k % 64);
+    }
+
+    //per batch: the union of each student's majors' courses, and what the kernel leaves of it
+    uint64_t *batch_major = (uint64_t *) malloc(sizeof(uint64_t) * ELIGIBLE_BATCH * words);
+    uint64_t *batch_eligible = (uint64_t *) malloc(sizeof(uint64_t) * ELIGIBLE_BATCH * words);
+    int32_t *candidates = (int32_t *) malloc(sizeof(int32_t) * (max_course + 1));
+
+    int first_term = students.start_term[0];
+    for (s = 1; s < students.count; s++)
+    {
+        if (students.start_term[s] < first_term)
+            first_term = students.start_term[s];
+    }
+
+    //courses students had before the run become completed as the simulation passes their terms
+    long num_pending = 0;
+    long next_pending = 0;
+    struct pending_done *pending = (struct pending_done *) malloc(sizeof(struct pending_done) * (ledger_cols.cap + 1));
+    for (s = 0; s < students.count; s++)
+    {
+        int32_t r;
+        for (r = students.ledger_start[s]; r < students.ledger_start[s] + students.ledger_existing[s]; r++)
+        {
+            pending[num_pending].term = ledger_cols.term[r];
+            pending[num_pending].s = s;
+            pending[num_pending].course = ledger_cols.course[r];
+            num_pending++;
+        }
+    }
+    qsort(pending, num_pending, sizeof(struct pending_done), compare_pending_done);
+
+    struct copy_stream copy = {0};
+    char row[64];
+    int next = 0;
+
+    //skip sections from before anybody enrolled
+    while (next < num_sections && catalog.sections[term_order[next]].year * NUM_QUARTERS + catalog.sections[term_order[next]].quarter < first_term)
+        next++;
+
+    while (next < num_sections)
+    {
+        struct catalog_section *head = &catalog.sections[term_order[next]];
+        int term = head->year * NUM_QUARTERS + head->quarter;
+        int term_first = next;
+        while (next < num_sections &&
+               catalog.sections[term_order[next]].year * NUM_QUARTERS + catalog.sections[term_order[next]].quarter == term)
+        {
+            int course = section_course(term_order[next]);
+            if (offered_count[course] == 0)
+                offered_first[course] = next;
+            offered_count[course]++;
+            offered_bits[course / 64] |= 1ULL << (course % 64);
+            next++;
+        }
+
+        for (; next_pending < num_pending && pending[next_pending].term < term; next_pending++)
+        {
+            struct pending_done *p = &pending[next_pending];
+            students.done_bits[(size_t) p->s * words + p->course / 64] |= 1ULL << (p->course % 64);
+        }
+
+        if (!dry_run)
+            copy_begin(conn, &copy, "copy registry.enrollment (student_id, crn) from stdin;");
+        long term_rows = 0;
+
+        int batch_first;
+        for (batch_first = 0; batch_first < students.count; batch_first += ELIGIBLE_BATCH)
+        {
+            int n = students.count - batch_first;
+            if (n > ELIGIBLE_BATCH)
+                n = ELIGIBLE_BATCH;
+
+            int b;
+            for (b = 0; b < n; b++)
+            {
+                uint64_t *row_major = &batch_major[(size_t) b * words];
+                memset(row_major, 0, sizeof(uint64_t) * words);
+                for (major = next_major(batch_first + b, -1); major >= 0; major = next_major(batch_first + b, major))
+                {
+                    for (w = 0; w < words; w++)
+                        row_major[w] |= major_bits[(size_t) major * words + w];
+                }
+            }
+
+            //students' taken_bits rows are consecutive, so the batch reads them in place
+            eligible_kernel(batch_major, &students.taken_bits[(size_t) batch_first * words], offered_bits, batch_eligible, words, n);
+
+            for (b = 0; b < n; b++)
+            {
+                s = batch_first + b;
+                if (students.start_term[s] > term)
+                    continue;
+
+                int in_term = student_in_term(s, term);
+                if (in_term >= 4)
+                    continue;
+
+                uint64_t *eligible = &batch_eligible[(size_t) b * words];
+                if (dry_run)
+                {
+                    uint64_t *row_major = &batch_major[(size_t) b * words];
+                    uint64_t *taken = &students.taken_bits[(size_t) s * words];
+                    for (w = 0; w < words; w++)
+                        stats.rejected_enrolled += __builtin_popcountll(row_major[w] & offered_bits[w] & taken[w]);
+                }
+
+                //only the few courses left that have prerequisites need a closer look
+                int num_candidates = 0;
+                for (w = 0; w < words; w++)
+                {
+                    uint64_t bits = eligible[w];
+                    while (bits != 0)
+                    {
+                        int course = w * 64 + __builtin_ctzll(bits);
+                        bits &= bits - 1;
+                        if ((prereq_bits[w] & (1ULL << (course % 64))) && !prereqs_done(s, course))
+                        {
+                            stats.rejected_prereq++;
+                            TRACE_COURSE_REJECT(students.id[s], course, "prereq");
+                            continue;
+                        }
+                        candidates[num_candidates++] = course;
+                    }
+                }
+                if (num_candidates == 0)
+                    continue;
+
+                //start at a random candidate so the same few don't always fill the term first
+                int first_course = rand_lim(num_candidates);
+                int c;
+                for (c = 0; c < num_candidates && in_term < 4; c++)
+                {
+                    int course = candidates[(first_course + c) % num_candidates];
+
+                    if (!policy_accept_course(NULL))
+                    {
+                        stats.rejected_threshold++;
+                        TRACE_COURSE_REJECT(students.id[s], course, "threshold");
+                        continue;
+                    }
+
+                    //any of the course's sections this term that still has a seat, starting at a random one
+                    int pick = rand_lim(offered_count[course]);
+                    struct catalog_section *section = NULL;
+                    int r;
+                    for (r = 0; r < offered_count[course] && section == NULL; r++)
+                    {
+                        struct catalog_section *candidate = &catalog.sections[term_order[offered_first[course] + (pick + r) % offered_count[course]]];
+                        if (claim_seat(candidate))
+                            section = candidate;
+                    }
+                    if (section == NULL)
+                    {
+                        stats.rejected_section_full++;
+                        TRACE_COURSE_REJECT(students.id[s], course, "section_full");
+                        continue;
+                    }
+                    TRACE_SECTION_SELECT(students.id[s], course, section->crn);
+
+                    //the candidates are already fixed, so marking it completed now can't unlock anything this term
+                    student_add_course(s, course, section->crn, term);
+                    students.done_bits[(size_t) s * words + course / 64] |= 1ULL << (course % 64);
+                    in_term++;
+                    term_rows++;
+
+                    if (dry_run)
+                    {
+                        stats_count_term(section->year, section->quarter);
+                        stats_count_section(section->crn);
+                    }
+                    else
+                    {
+                        sprintf(row, "%d\t%d\n", students.id[s], section->crn);
+                        copy_row(&copy, row);
+                        journal_add(students.id[s], section->crn);
+                    }
+                }
+            }
+        }
+
+        //the whole term goes in as one COPY, so a failure leaves earlier terms intact and this one empty
+        if (!dry_run)
+        {
+            copy_end(&copy, "Writing term enrollment");
+            journal_commit();
+        }
+        if (DEBUG)
+            fprintf(f, "%s %d: %ld enrollments\n", quarter_names[term % NUM_QUARTERS], term / NUM_QUARTERS, term_rows);
+
+        for (k = term_first; k < next; k++)
+            offered_count[section_course(term_order[k])] = 0;
+        memset(offered_bits, 0, sizeof(uint64_t) * words);
+    }
+
+    if (dry_run)
+    {
+        for (s = 0; s < students.count; s++)
+            stats_finish_student(students.gpa[s] / 100.0, students.ledger_len[s] - students.ledger_existing[s]);
+    }
+
+    free(term_order);
+    free(offered_first);
+    free(offered_count);
+    free(major_bits);
+    free(prereq_bits);
+    free(offered_bits);
+    free(batch_major);
+    free(batch_eligible);
+    free(candidates);
+    free(pending);
+    free_students();
+    return 0;
+}
+
+//generates for every student past the watermark; returns how many students were processed
+int run_delta(PGconn *conn, FILE *f)
+{
+    int last_id = read_watermark(conn, WATERMARK_NAME);
+    int processed = 0;
+
+    //students that committed below the watermark after it moved past them, i.e. ones still without any enrollment
+    if (last_id > 0)
+    {
+        char *late_buffer = (char *) malloc(sizeof(char) * 1024);
+        sprintf(late_buffer, "select s.id from registry.student s where s.id > %d and s.id <= %d "
+                "and not exists (select 1 from registry.enrollment e where e.student_id = s.id) order by s.id;",
+                last_id - WATERMARK_SLACK, last_id);
+        PGresult *late = traced_exec(conn, late_buffer);
+        free(late_buffer);
+        if (PQresultStatus(late) != PGRES_TUPLES_OK)
+            exit_nicely(conn, "Getting late students");
+
+        int n = PQntuples(late);
+        if (n > 0)
+        {
+            PGresult *txn = traced_exec(conn, "begin;");
+            if (PQresultStatus(txn) != PGRES_COMMAND_OK)
+                exit_nicely(conn, "Starting late student transaction");
+            PQclear(txn);
+            in_transaction = 1;
+
+            int k;
+            for (k = 0; k < n; k++)
+                generate_student(conn, f, atoi(PQgetvalue(late, k, 0)));
+
+            txn = traced_exec(conn, "commit;");
+            if (PQresultStatus(txn) != PGRES_COMMAND_OK)
+                exit_nicely(conn, "Committing late students");
+            PQclear(txn);
+            in_transaction = 0;
+            journal_commit();
+            processed += n;
+        }
+        PQclear(late);
+    }
+
+    //students per committed chunk: bigger chunks commit less often, smaller ones hold locks for less time
+    struct autotune chunk;
+    autotune_init(&chunk, "chunk", "EE_CHUNK", DEFAULT_RANGE_SIZE, 10, 5000, 50, 1);
+
+    while (1)
+    {
+        //an index range scan on the primary key, however big the table is
+        double chunk_started = now_ms();
+        char *delta_buffer = (char *) malloc(sizeof(char) * 1024);
+        sprintf(delta_buffer, "select s.id from registry.student s where s.id > %d order by s.id limit %d;", last_id, chunk.value);
+        PGresult *res = traced_exec(conn, delta_buffer);
+        free(delta_buffer);
+
+        if (PQresultStatus(res) != PGRES_TUPLES_OK)
+            exit_nicely(conn, "Getting new students");
+
+        int n = PQntuples(res);
+        if (n == 0)
+        {
+            PQclear(res);
+            break;
+        }
+
+        //a chunk and its watermark commit together, so a crash never skips or doubles a student
+        PGresult *txn = traced_exec(conn, "begin;");
+        if (PQresultStatus(txn) != PGRES_COMMAND_OK)
+            exit_nicely(conn, "Starting chunk transaction");
+        PQclear(txn);
+        in_transaction = 1;
+
+        int k;
+        for (k = 0; k < n; k++)
+            generate_student(conn, f, atoi(PQgetvalue(res, k, 0)));
+
+        last_id = atoi(PQgetvalue(res, n - 1, 0));
+        write_watermark(conn, WATERMARK_NAME, last_id);
+
+        double commit_started = now_ms();
+        txn = traced_exec(conn, "commit;");
+        if (PQresultStatus(txn) != PGRES_COMMAND_OK)
+            exit_nicely(conn, "Committing new students");
+        PQclear(txn);
+        in_transaction = 0;
+        journal_commit();
+
+        double done = now_ms();
+        autotune_sample(&chunk, f, n, done - chunk_started, done - commit_started);
+
+        processed += n;
+        PQclear(res);
+    }
+
+    if (DEBUG)
+        fprintf(f, "Delta: %d new students, watermark now %d\n", processed, last_id);
+    if (processed > 0)
+        autotune_report(&chunk, f);
+    return processed;
+}
+
+int run_incremental(PGconn *conn, FILE *f, int listen)
+{
+    ensure_watermark_table(conn);
+
+    if (listen)
+    {
+        //subscribe before the first pass, so students added while it runs still wake us up
+        PGresult *res = traced_exec(conn, "listen " NEW_STUDENT_CHANNEL ";");
+        if (PQresultStatus(res) != PGRES_COMMAND_OK)
+            exit_nicely(conn, "Listening for new students");
+        PQclear(res);
+    }
+
+    int processed = run_delta(conn, f);
+    fprintf(stderr, "Processed %d new students\n", processed);
+
+    while (listen)
+    {
+        int sock = PQsocket(conn);
+        fd_set input;
+        FD_ZERO(&input);
+        FD_SET(sock, &input);
+
+        if (select(sock + 1, &input, NULL, NULL, NULL) < 0)
+            exit_nicely(conn, "Waiting for new students");
+
+        PQconsumeInput(conn);
+        if (PQstatus(conn) != CONNECTION_OK)
+            exit_nicely(conn, "Waiting for new students");
+
+        //any number of notifications just means "look past the watermark again"
+        PGnotify *notify;
+        int woken = 0;
+        while ((notify = PQnotifies(conn)) != NULL)
+        {
+            woken = 1;
+            PQfreemem(notify);
+        }
+
+        if (woken)
+        {
+            processed = run_delta(conn, f);
+            fprintf(stderr, "Processed %d new students\n", processed);
+            fflush(f);
+        }
+    }
+
+    return 0;
+}
+
+int regrade_student(PGconn *conn, FILE *f, int student_id)
+{
+    //grade every enrollment the student has and set their gpa to the mean of the new grades, the way
+    //embedded_enrollment_grades does, in one transaction so the gpa never disagrees with the grades
+    char *student_buffer = (char *) malloc(sizeof(char) * 1024);
+    sprintf(student_buffer, "select s.gpa, e.crn from registry.student s join registry.enrollment e on e.student_id=s.id where s.id=%d;", student_id);
+    PGresult *res = traced_exec(conn, student_buffer);
+    free(student_buffer);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+        exit_nicely(conn, "Getting enrollment to regrade");
+
+    int rows = PQntuples(res);
+    if (rows == 0)
+    {
+        PQclear(res);
+        return 0;
+    }
+
+    char *update_buffer = (char *) malloc(sizeof(char) * (128 + rows * 32));
+    int used = sprintf(update_buffer, "update registry.enrollment e set grade = v.grade from (values ");
+    double points = 0;
+    int r;
+    for (r = 0; r < rows; r++)
+    {
+        char *grade = policy_grade(atof(PQgetvalue(res, r, 0)), NULL);
+        points += grade_point(grade);
+        used += sprintf(update_buffer + used, "%s(%d, '%s')", r ? ", " : "", atoi(PQgetvalue(res, r, 1)), grade);
+    }
+    sprintf(update_buffer + used, ") v(crn, grade) where e.student_id = %d and e.crn = v.crn;", student_id);
+    PQclear(res);
+
+    res = traced_exec(conn, "begin;");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        exit_nicely(conn, "Starting regrade transaction");
+    PQclear(res);
+
+    res = traced_exec(conn, update_buffer);
+    free(update_buffer);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        exit_nicely(conn, "Regrading student");
+    PQclear(res);
+
+    char gpa_buffer[128];
+    sprintf(gpa_buffer, "update registry.student set gpa = %.2f where id = %d;", points / rows, student_id);
+    res = traced_exec(conn, gpa_buffer);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        exit_nicely(conn, "Updating regraded gpa");
+    PQclear(res);
+
+    res = traced_exec(conn, "commit;");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        exit_nicely(conn, "Committing regrade");
+    PQclear(res);
+
+    if (DEBUG)
+        fprintf(f, "Regraded %d enrollments for student %d\n", rows, student_id);
+    return rows;
+}
+
+void daemon_refresh_catalog(PGconn *conn, FILE *f, int force)
+{
+    //one cheap query per request; only a changed catalog pays for a reload
+    if (!force && catalog_checksum(conn) == catalog.hdr->checksum)
+        return;
+
+    catalog_close(&catalog);
+    catalog_open(conn, &catalog, f);
+    free(seats_taken);
+    seats_taken = (int32_t *) calloc(catalog.hdr->num_sections + 1, sizeof(int32_t));
+    load_seats(conn);
+    metrics.catalog_reloads++;
+}
+
+//handles one request line, writing the reply to out; 1 when the daemon should stop
+int daemon_request(PGconn *conn, FILE *f, char *line, FILE *out)
+{
+    char *words[MAX_REQUEST / 2];
+    int num_words = 0;
+    char *word = strtok(line, " \t\r\n");
+    while (word != NULL && num_words < MAX_REQUEST / 2)
+    {
+        words[num_words++] = word;
+        word = strtok(NULL, " \t\r\n");
+    }
+    if (num_words == 0)
+        return 0;
+
+    char *command = words[0];
+    int k;
+
+    if (strcmp(command, "metrics") == 0)
+    {
+        fprintf(out, "uptime_secs %ld\n", (long) (time(NULL) - metrics.started));
+        fprintf(out, "requests %ld\n", metrics.requests);
+        fprintf(out, "failed_requests %ld\n", metrics.failed_requests);
+        fprintf(out, "students %ld\n", metrics.students);
+        fprintf(out, "enrollments %ld\n", metrics.enrollments);
+        fprintf(out, "regraded %ld\n", metrics.regraded);
+        fprintf(out, "queries %ld\n", queries_issued);
+        fprintf(out, "catalog_reloads %ld\n", metrics.catalog_reloads);
+        fprintf(out, "catalog_sections %d\n", catalog.hdr->num_sections);
+        fprintf(out, "mean_request_ms %.3f\n", metrics.requests ? metrics.busy_ms / metrics.requests : 0.0);
+        fprintf(out, "max_request_ms %.3f\n", metrics.max_request_ms);
+        fprintf(out, "OK\n");
+        return 0;
+    }
+
+    if (strcmp(command, "shutdown") == 0)
+    {
+        fprintf(out, "OK\n");
+        return 1;
+    }
+
+    if (strcmp(command, "reload") == 0)
+        daemon_refresh_catalog(conn, f, 1);
+    else if (strcmp(command, "generate") == 0 || strcmp(command, "dry-run") == 0)
+    {
+        daemon_refresh_catalog(conn, f, 0);
+
+        //a what-if run leaves no trace: its seats are handed back and its statistics go to the client
+        int32_t *seats_before = NULL;
+        if (strcmp(command, "dry-run") == 0)
+        {
+            dry_run = 1;
+            reset_stats();
+            seats_before = (int32_t *) malloc(sizeof(int32_t) * (catalog.hdr->num_sections + 1));
+            memcpy(seats_before, seats_taken, sizeof(int32_t) * (catalog.hdr->num_sections + 1));
+        }
+
+        long added = 0;
+        for (k = 1; k < num_words; k++)
+            added += generate_student(conn, f, atoi(words[k]));
+        metrics.students += num_words - 1;
+
+        if (seats_before != NULL)
+        {
+            print_dry_run_stats(conn, out);
+            memcpy(seats_taken, seats_before, sizeof(int32_t) * (catalog.hdr->num_sections + 1));
+            free(seats_before);
+            dry_run = 0;
+        }
+        else
+        {
+            metrics.enrollments += added;
+            fprintf(out, "enrollments %ld\n", added);
+        }
+    }
+    else if (strcmp(command, "range") == 0 && num_words == 3)
+    {
+        daemon_refresh_catalog(conn, f, 0);
+
+        const char *params[2] = { words[1], words[2] };
+        PGresult *res = traced_exec_params(conn, "select s.id from registry.student s where s.id between $1 and $2 order by s.id;",
+                                           2, NULL, params, NULL, NULL, 0);
+        if (PQresultStatus(res) != PGRES_TUPLES_OK)
+            exit_nicely(conn, "Getting student range");
+
+        long added = 0;
+        for (k = 0; k < PQntuples(res); k++)
+            added += generate_student(conn, f, atoi(PQgetvalue(res, k, 0)));
+        metrics.students += PQntuples(res);
+        metrics.enrollments += added;
+        fprintf(out, "students %d enrollments %ld\n", PQntuples(res), added);
+        PQclear(res);
+    }
+    else if (strcmp(command, "regrade") == 0)
+    {
+        long regraded = 0;
+        for (k = 1; k < num_words; k++)
+            regraded += regrade_student(conn, f, atoi(words[k]));
+        metrics.regraded += regraded;
+        fprintf(out, "regraded %ld\n", regraded);
+    }
+    else
+    {
+        fprintf(out, "ERR unknown request %s\n", command);
+        return 0;
+    }
+
+    fprintf(out, "OK\n");
+    return 0;
+}
+
+int run_daemon(PGconn *conn, FILE *f, const char *path)
+{
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path %s is too long\n", path);
+        close(listener);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    //a socket left behind by a daemon that died is in the way of binding a new one
+    unlink(path);
+    if (bind(listener, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listener, 16) != 0)
+    {
+        perror(path);
+        close(listener);
+        return -1;
+    }
+
+    //a client that hangs up mid reply must not take the daemon with it
+    signal(SIGPIPE, SIG_IGN);
+    metrics.started = time(NULL);
+    fprintf(stderr, "Serving requests on %s\n", path);
+
+    int stop = 0;
+    char line[MAX_REQUEST];
+    jmp_buf failed_jmp;
+
+    while (!stop)
+    {
+        int client = accept(listener, NULL, NULL);
+        if (client < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("accept");
+            break;
+        }
+
+        //separate streams for each direction, a socket can't be read and written through one FILE
+        FILE *in = fdopen(client, "r");
+        FILE *out = fdopen(dup(client), "w");
+        if (in == NULL || out == NULL)
+        {
+            if (in != NULL)
+                fclose(in);
+            else
+                close(client);
+            if (out != NULL)
+                fclose(out);
+            continue;
+        }
+
+        while (!stop && fgets(line, sizeof(line), in) != NULL)
+        {
+            //the connection is the one warm thing that can go away under us
+            if (PQstatus(conn) != CONNECTION_OK)
+                PQreset(conn);
+
+            struct timespec begin, end;
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+
+            if (setjmp(failed_jmp) == 0)
+            {
+                request_jmp = &failed_jmp;
+                stop = daemon_request(conn, f, line, out);
+            }
+            else
+            {
+                //whatever was half done is gone, put the in-memory state back to what the DB has; a failure
+                //while doing that is not something another request can fix, so it exits
+                request_jmp = NULL;
+                dry_run = 0;
+                trace_student = 0;
+                metrics.failed_requests++;
+                if (PQstatus(conn) == CONNECTION_OK && PQtransactionStatus(conn) != PQTRANS_IDLE)
+                    PQclear(traced_exec(conn, "rollback;"));
+                if (PQstatus(conn) == CONNECTION_OK)
+                    daemon_refresh_catalog(conn, f, 1);
+                fprintf(out, "ERR request failed\n");
+            }
+            request_jmp = NULL;
+
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double ms = (end.tv_sec - begin.tv_sec) * 1000.0 + (end.tv_nsec - begin.tv_nsec) / 1000000.0;
+            metrics.requests++;
+            metrics.busy_ms += ms;
+            if (ms > metrics.max_request_ms)
+                metrics.max_request_ms = ms;
+
+            fflush(out);
+            fflush(f);
+        }
+
+        fclose(in);
+        fclose(out);
+    }
+
+    close(listener);
+    unlink(path);
+    return 0;
+}
+
+//1 if the row went in, 0 if the queue is full
+int plan_push(struct plan_queue *queue, int student_id, int crn)
+{
+    uint64_t pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    while (1)
+    {
+        struct plan_cell *cell = &queue->cells[pos & queue->mask];
+        uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t) seq - (int64_t) pos;
+
+        if (diff == 0)
+        {
+            //the slot is free for this lap; whoever moves head past it owns it
+            if (__atomic_compare_exchange_n(&queue->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                cell->student_id = student_id;
+                cell->crn = crn;
+                __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+        else if (diff < 0)
+            return 0;
+        else
+            pos = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    }
+}
+
+//1 if a row came out, 0 if the queue is empty; only ever called from the writer
+int plan_pop(struct plan_queue *queue, int *student_id, int *crn)
+{
+    struct plan_cell *cell = &queue->cells[queue->tail & queue->mask];
+    uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    if (seq != queue->tail + 1)
+        return 0;
+
+    *student_id = cell->student_id;
+    *crn = cell->crn;
+    //hand the slot back to the planners for the next lap round the ring
+    __atomic_store_n(&cell->seq, queue->tail + queue->mask + 1, __ATOMIC_RELEASE);
+    queue->tail++;
+    return 1;
+}
+
+//generate_student's choices for student s, from memory only: nothing here may touch the connection
+int plan_student(int s, unsigned int *seed, struct plan_queue *queue)
+{
+    int planned = 0;
+    int major;
+
+    for (major = next_major(s, -1); major >= 0; major = next_major(s, major))
+    {
+        int NUM_COURSES;
+        int32_t *courses = catalog_major_courses(&catalog, major, &NUM_COURSES);
+        int c;
+        for (c = 0; c < NUM_COURSES; c++)
+        {
+            if (!policy_accept_course(seed))
+                continue;
+
+            if (student_has_course(s, courses[c], -1))
+                continue;
+
+            int NUM_SECTIONS;
+            struct catalog_section *sections = catalog_course_sections(&catalog, courses[c], &NUM_SECTIONS);
+            if (NUM_SECTIONS < 1)
+                continue;
+
+            int retry;
+            for (retry = 0; retry < 4; retry++)
+            {
+                struct catalog_section *section = &sections[policy_first_section(NUM_SECTIONS, seed)];
+                int term = section->year * NUM_QUARTERS + section->quarter;
+
+                //before the student started there is nothing to retry, as in generate_student
+                if (term < students.start_term[s])
+                    break;
+                if (student_in_term(s, term) > 3)
+                    continue;
+
+                //take a seat, falling back to the next section of the course that fits if this one is full
+                struct catalog_section *taken = claim_seat(section) ? section : NULL;
+                int k;
+                for (k = 1; k < NUM_SECTIONS && taken == NULL; k++)
+                {
+                    struct catalog_section *next = &sections[(section - sections + k) % NUM_SECTIONS];
+                    int next_term = next->year * NUM_QUARTERS + next->quarter;
+                    if (next_term >= students.start_term[s] && student_in_term(s, next_term) <= 3 && claim_seat(next))
+                        taken = next;
+                }
+                if (taken == NULL)
+                    break;
+
+                student_add_course(s, courses[c], taken->crn, taken->year * NUM_QUARTERS + taken->quarter);
+                TRACE_SECTION_SELECT(students.id[s], courses[c], taken->crn);
+
+                //backpressure: a full queue means the writer is behind, so wait for it instead of growing
+                if (!plan_push(queue, students.id[s], taken->crn))
+                {
+                    __atomic_fetch_add(&queue->full_waits, 1, __ATOMIC_RELAXED);
+                    while (!plan_push(queue, students.id[s], taken->crn))
+                        sched_yield();
+                }
+                planned++;
+                break;
+            }
+        }
+    }
+    return planned;
+}
+
+int next_planned_student = 0;
+
+void *planner_thread(void *arg)
+{
+    struct planner_args *args = (struct planner_args *) arg;
+    while (1)
+    {
+        //parked by the writer while planning is ahead of what it can write
+        while (args->index >= __atomic_load_n(&args->queue->active_planners, __ATOMIC_RELAXED) &&
+               __atomic_load_n(&next_planned_student, __ATOMIC_RELAXED) < students.count)
+            usleep(1000);
+
+        //students are handed out a chunk at a time, so a planner with slow students doesn't hold up the rest
+        int first = __atomic_fetch_add(&next_planned_student, PLANNER_CHUNK, __ATOMIC_RELAXED);
+        if (first >= students.count)
+            break;
+
+        int s;
+        for (s = first; s < first + PLANNER_CHUNK && s < students.count; s++)
+            args->planned += plan_student(s, &args->seed, args->queue);
+    }
+
+    __atomic_fetch_sub(&args->queue->planners_left, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+int run_pipeline(PGconn *conn, FILE *f, int num_planners)
+{
+    //threads for as many planners as could help; the tuner decides how many of them plan
+    struct autotune planners;
+    int max_planners = num_planners;
+    if (max_planners < 1)
+    {
+        max_planners = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+        if (max_planners < 1)
+            max_planners = 1;
+    }
+    autotune_init(&planners, "planners", "EE_PLANNERS", max_planners, 1, max_planners, 1, 0);
+    if (num_planners >= 1)
+    {
+        planners.value = num_planners;
+        planners.pinned = 1;
+    }
+    else if (planners.pinned)
+        max_planners = planners.max = planners.value;
+    num_planners = max_planners;
+
+    struct autotune batch;
+    autotune_init(&batch, "batch", "EE_BATCH", PIPELINE_BATCH, 1000, 500000, 5000, 1);
+
+    load_students(conn);
+    if (DEBUG)
+        fprintf(f, "Pipeline: %d students, %d planners\n", students.count, num_planners);
+
+    struct plan_queue queue;
+    memset(&queue, 0, sizeof(queue));
+    queue.cells = (struct plan_cell *) malloc(sizeof(struct plan_cell) * PLAN_QUEUE_SIZE);
+    queue.mask = PLAN_QUEUE_SIZE - 1;
+    queue.planners_left = num_planners;
+    queue.active_planners = planners.value;
+    uint64_t k;
+    for (k = 0; k < PLAN_QUEUE_SIZE; k++)
+        queue.cells[k].seq = k;
+
+    next_planned_student = 0;
+    pthread_t *threads = (pthread_t *) malloc(sizeof(pthread_t) * num_planners);
+    struct planner_args *args = (struct planner_args *) calloc(num_planners, sizeof(struct planner_args));
+    int t;
+    for (t = 0; t < num_planners; t++)
+    {
+        args[t].queue = &queue;
+        args[t].index = t;
+        args[t].seed = (unsigned int) (run_seed ^ (t * 2654435761u));
+        if (pthread_create(&threads[t], NULL, planner_thread, &args[t]) != 0)
+            exit_nicely(conn, "Starting planner threads");
+    }
+
+    //this thread is the writer: the connection is only ever used from here
+    struct copy_stream copy;
+    char row[64];
+    int in_copy = 0;
+    long written = 0;
+    long batches = 0;
+    long empty_waits = 0;
+    double batch_started = 0;
+    int student_id, crn;
+
+    while (1)
+    {
+        //read before looking at the queue: if every planner was done by then, an empty queue really is the end
+        int finished = __atomic_load_n(&queue.planners_left, __ATOMIC_ACQUIRE) == 0;
+
+        if (plan_pop(&queue, &student_id, &crn))
+        {
+            if (!in_copy)
+            {
+                copy_begin(conn, &copy, "copy registry.enrollment (student_id, crn) from stdin;");
+                in_copy = 1;
+                batch_started = now_ms();
+            }
+            sprintf(row, "%d\t%d\n", student_id, crn);
+            copy_row(&copy, row);
+            journal_add(student_id, crn);
+            written++;
+
+            //each batch commits on its own, so a failure loses at most the batch in flight
+            if (copy.rows >= batch.value)
+            {
+                long rows = copy.rows;
+                double commit_started = now_ms();
+                copy_end(&copy, "Writing enrollment batch");
+                journal_commit();
+                in_copy = 0;
+                batches++;
+
+                //one knob per window, so each sees the effect of its own last move
+                double done = now_ms();
+                if (batches % 2)
+                    autotune_sample(&batch, f, rows, done - batch_started, done - commit_started);
+                else
+                {
+                    int active = autotune_sample(&planners, f, rows, done - batch_started, done - commit_started);
+                    __atomic_store_n(&queue.active_planners, active, __ATOMIC_RELAXED);
+                }
+            }
+            continue;
+        }
+
+        if (finished)
+            break;
+
+        //the planners are the bottleneck right now; ship what there is so the DB works meanwhile
+        empty_waits++;
+        if (in_copy && copy.used > 0)
+        {
+            if (PQputCopyData(conn, copy.buffer, copy.used) != 1)
+                exit_nicely(conn, "Sending COPY data");
+            copy.used = 0;
+        }
+        sched_yield();
+    }
+
+    if (in_copy)
+    {
+        copy_end(&copy, "Writing enrollment batch");
+        journal_commit();
+        batches++;
+    }
+
+    long planned = 0;
+    for (t = 0; t < num_planners; t++)
+    {
+        pthread_join(threads[t], NULL);
+        planned += args[t].planned;
+    }
+
+    fprintf(stderr, "Pipeline wrote %ld enrollments for %d students in %ld COPY batches (%d planners, %ld full queue waits, %ld empty queue waits)\n",
+            written, students.count, batches, num_planners, queue.full_waits, empty_waits);
+    autotune_report(&batch, f);
+    autotune_report(&planners, f);
+    if (DEBUG)
+        fprintf(f, "Pipeline planned %ld, wrote %ld in %ld batches\n", planned, written, batches);
+
+    free(threads);
+    free(args);
+    free(queue.cells);
+    free_students();
+    return 0;
+}
+
+//per student queries as the generators issue them; student context is STUDENT_CONTEXT_QUERY
+const struct preflight_query preflight_queries[] = {
+    { "student", "select s.enrollment_date, s.gpa from registry.student s where s.id=$1;" },
+    { "majors", "select sm.major_id from registry.student_major sm where sm.student_id=$1;" },
+    { "existing enrollment", "select s.course_id, s.crn, s.year, s.quarter from registry.enrollment e join registry.section s on s.crn=e.crn where e.student_id=$1;" },
+    { "regrade", "select s.gpa, e.crn from registry.student s join registry.enrollment e on e.student_id=s.id where s.id=$1;" },
+    { "grade update", "update registry.enrollment set grade='A' where student_id = $1 and crn = 0;" },
+    { NULL, NULL }
+};
+
+const struct preflight_index preflight_indexes[] = {
+    { "enrollment", "student_id", "create index concurrently if not exists enrollment_student_id_idx on registry.enrollment (student_id);" },
+    { "enrollment", "crn", "create index concurrently if not exists enrollment_crn_idx on registry.enrollment (crn);" },
+    { "section", "course_id", "create index concurrently if not exists section_course_id_idx on registry.section (course_id);" },
+    { "student_major", "student_id", "create index concurrently if not exists student_major_student_id_idx on registry.student_major (student_id);" },
+    { "prerequisite", "course_id", "create index concurrently if not exists prerequisite_course_id_idx on registry.prerequisite (course_id);" },
+    { NULL, NULL, NULL }
+};
+
+//sql with every $1 replaced by the id, in a buffer the caller frees
+char *bind_student(const char *sql, int student_id)
+{
+    char id_text[32];
+    int id_len = sprintf(id_text, "%d", student_id);
+    char *bound = (char *) malloc(strlen(sql) * (id_len + 1) + 1);
+    char *out = bound;
+
+    while (*sql)
+    {
+        if (sql[0] == '$' && sql[1] == '1')
+        {
+            memcpy(out, id_text, id_len);
+            out += id_len;
+            sql += 2;
+        }
+        else
+            *out++ = *sql++;
+    }
+    *out = '\0';
+    return bound;
+}
+
+//1 if some index on registry.table has column as its first key
+int has_leading_index(PGconn *conn, const char *table, const char *column)
+{
+    const char *params[2] = { table, column };
+    PGresult *res = traced_exec_params(conn, "select 1 from pg_index i join pg_class c on c.oid = i.indrelid "
+                                             "join pg_namespace n on n.oid = c.relnamespace "
+                                             "join pg_attribute a on a.attrelid = i.indrelid and a.attnum = i.indkey[0] "
+                                             "where n.nspname = 'registry' and c.relname = $1 and a.attname = $2 and i.indisvalid;",
+                                       2, NULL, params, NULL, NULL, 0);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+        exit_nicely(conn, "Looking up indexes");
+    int found = PQntuples(res) > 0;
+    PQclear(res);
+    return found;
+}
+
+//EXPLAINs every per student query and reports sequential scans on large tables; with fix, indexes them.
+//Returns how many large table scans there were.
+int preflight_scans(PGconn *conn, FILE *f, int student_id, int fix)
+{
+    int slow = 0;
+    int q;
+    for (q = 0; ; q++)
+    {
+        const char *name = preflight_queries[q].name ? preflight_queries[q].name : "student context";
+        const char *sql = preflight_queries[q].name ? preflight_queries[q].sql : STUDENT_CONTEXT_QUERY;
+
+        char *bound = bind_student(sql, student_id);
+        char *explain = (char *) malloc(strlen(bound) + 16);
+        sprintf(explain, "explain %s", bound);
+        PGresult *plan = traced_exec(conn, explain);
+        free(explain);
+        free(bound);
+        if (PQresultStatus(plan) != PGRES_TUPLES_OK)
+            exit_nicely(conn, "Explaining generator query");
+
+        int r;
+        for (r = 0; r < PQntuples(plan); r++)
+        {
+            //text plans name the scanned table right after "Seq Scan on ", without the schema
+            char *line = PQgetvalue(plan, r, 0);
+            char *scan = strstr(line, "Seq Scan on ");
+            if (scan == NULL)
+                continue;
+
+            char table[64];
+            if (sscanf(scan + strlen("Seq Scan on "), "%63s", table) != 1)
+                continue;
+
+            const char *params[1] = { table };
+            PGresult *size = traced_exec_params(conn, "select c.reltuples::bigint from pg_class c join pg_namespace n on n.oid = c.relnamespace "
+                                                      "where n.nspname = 'registry' and c.relname = $1;",
+                                                1, NULL, params, NULL, NULL, 0);
+            if (PQresultStatus(size) != PGRES_TUPLES_OK)
+                exit_nicely(conn, "Getting table size");
+            //never analyzed comes back as -1 (or 0): assume the worst
+            long rows = PQntuples(size) > 0 ? atol(PQgetvalue(size, 0, 0)) : 0;
+            PQclear(size);
+            if (rows > 0 && rows < PREFLIGHT_LARGE_ROWS)
+                continue;
+
+            slow++;
+            if (rows > 0)
+                fprintf(stderr, "PREFLIGHT: %s query scans all of registry.%s (~%ld rows)\n", name, table, rows);
+            else
+                fprintf(stderr, "PREFLIGHT: %s query scans all of registry.%s (not analyzed)\n", name, table);
+
+            if (!fix)
+                continue;
+
+            int k;
+            for (k = 0; preflight_indexes[k].table; k++)
+            {
+                if (strcmp(preflight_indexes[k].table, table) != 0 || has_leading_index(conn, table, preflight_indexes[k].column))
+                    continue;
+
+                //concurrently, so a live registry keeps taking writes while the index builds
+                fprintf(stderr, "PREFLIGHT: %s\n", preflight_indexes[k].create);
+                PGresult *made = traced_exec(conn, preflight_indexes[k].create);
+                if (PQresultStatus(made) != PGRES_COMMAND_OK)
+                    fprintf(stderr, "PREFLIGHT: index creation failed: %s", PQerrorMessage(conn));
+                PQclear(made);
+
+                made = traced_exec(conn, "analyze registry.enrollment, registry.section, registry.student_major, registry.prerequisite;");
+                PQclear(made);
+            }
+        }
+        PQclear(plan);
+
+        if (preflight_queries[q].name == NULL)
+            break;
+    }
+
+    if (DEBUG)
+        fprintf(f, "Preflight found %d large table scans\n", slow);
+    return slow;
+}
+
+int run_preflight(PGconn *conn, FILE *f, int fix)
+{
+    //any real id will do, the point is the plan shape and not the rows
+    PGresult *res = traced_exec(conn, "select coalesce(min(id), 1) from registry.student;");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+        exit_nicely(conn, "Picking a student for preflight");
+    int student_id = atoi(PQgetvalue(res, 0, 0));
+    PQclear(res);
+
+    int slow = preflight_scans(conn, f, student_id, fix);
+    if (slow && fix)
+    {
+        slow = preflight_scans(conn, f, student_id, 0);
+        fprintf(stderr, "PREFLIGHT: %d large table scans left after adding indexes\n", slow);
+    }
+    else if (!slow)
+        fprintf(stderr, "PREFLIGHT: no sequential scans on large tables\n");
+    return slow;
+}
+
+void journal_open(FILE *f, uint64_t seed)
+{
+    const char *dir = getenv("EE_JOURNAL_DIR");
+    if (dir == NULL)
+        dir = ".";
+
+    //run ids sort by start time and stay unique across processes started in the same second
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    char stamp[16];
+    strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", &tm);
+    snprintf(journal.run_id, sizeof(journal.run_id), "%s-%d", stamp, (int) getpid());
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/embedded_enrollment.%s.journal", dir, journal.run_id);
+    journal.file = fopen(path, "wb");
+    if (journal.file == NULL)
+    {
+        fprintf(stderr, "NOTE: could not create journal %s, this run can't be undone or replayed\n", path);
+        return;
+    }
+
+    struct journal_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+    hdr.version = JOURNAL_VERSION;
+    memcpy(hdr.run_id, journal.run_id, sizeof(hdr.run_id));
+    hdr.seed = seed;
+    hdr.started = (int64_t) now;
+    if (fwrite(&hdr, sizeof(hdr), 1, journal.file) != 1 || fflush(journal.file) != 0)
+    {
+        fprintf(stderr, "NOTE: could not write journal %s, this run can't be undone or replayed\n", path);
+        fclose(journal.file);
+        journal.file = NULL;
+        return;
+    }
+
+    //committed batches are already flushed, so closing at exit only drops rows that never committed
+    atexit(journal_close);
+    fprintf(stderr, "Run %s (seed %llu), journal %s\n", journal.run_id, (unsigned long long) seed, path);
+    if (DEBUG)
+        fprintf(f, "Journal %s\n", path);
+}
+
+void journal_add(int student_id, int crn)
+{
+    if (journal.file == NULL)
+        return;
+
+    if (journal.count == journal.cap)
+    {
+        journal.cap = journal.cap ? journal.cap * 2 : 1024;
+        journal.buffer = (struct journal_row *) realloc(journal.buffer, sizeof(struct journal_row) * journal.cap);
+        if (journal.buffer == NULL)
+        {
+            fprintf(stderr, "Out of memory for the journal\n");
+            exit (1);
+        }
+    }
+
+    struct journal_row *row = &journal.buffer[journal.count++];
+    row->student_id = student_id;
+    row->crn = crn;
+    memset(row->grade, 0, sizeof(row->grade));
+}
+
+//called right after the rows added since the last call were committed to the DB
+void journal_commit(void)
+{
+    if (journal.file == NULL || journal.count == 0)
+        return;
+
+    struct journal_batch batch;
+    batch.magic = JOURNAL_BATCH_MAGIC;
+    batch.rows = journal.count;
+    if (fwrite(&batch, sizeof(batch), 1, journal.file) != 1 ||
+        fwrite(journal.buffer, sizeof(struct journal_row), journal.count, journal.file) != (size_t) journal.count ||
+        fflush(journal.file) != 0)
+    {
+        fprintf(stderr, "NOTE: writing the journal failed, it stops at the last complete batch\n");
+        fclose(journal.file);
+        journal.file = NULL;
+    }
+    journal.count = 0;
+}
+
+//the rows added since the last commit were rolled back
+void journal_discard(void)
+{
+    journal.count = 0;
+}
+
+void journal_close(void)
+{
+    if (journal.file != NULL)
+        fclose(journal.file);
+    journal.file = NULL;
+    free(journal.buffer);
+    journal.buffer = NULL;
+    journal.count = journal.cap = 0;
+}
+
+struct journal_row *journal_read(const char *run, struct journal_header *hdr, long *count)
+{
+    //a run id is looked for where runs write their journals, anything with a slash is taken as a path
+    char path[1024];
+    if (strchr(run, '/') != NULL)
+        snprintf(path, sizeof(path), "%s", run);
+    else
+    {
+        const char *dir = getenv("EE_JOURNAL_DIR");
+        snprintf(path, sizeof(path), "%s/embedded_enrollment.%s.journal", dir ? dir : ".", run);
+    }
+
+    FILE *in = fopen(path, "rb");
+    if (in == NULL)
+    {
+        fprintf(stderr, "Could not open journal %s\n", path);
+        return NULL;
+    }
+
+    if (fread(hdr, sizeof(*hdr), 1, in) != 1 || memcmp(hdr->magic, JOURNAL_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != JOURNAL_VERSION)
+    {
+        fprintf(stderr, "%s is not a journal of this version\n", path);
+        fclose(in);
+        return NULL;
+    }
+
+    struct journal_row *rows = NULL;
+    long cap = 0;
+    *count = 0;
+    struct journal_batch batch;
+    while (fread(&batch, sizeof(batch), 1, in) == 1)
+    {
+        if (batch.magic != JOURNAL_BATCH_MAGIC)
+            break;
+
+        if (*count + batch.rows > cap)
+        {
+            while (*count + batch.rows > cap)
+                cap = cap ? cap * 2 : 1024;
+            rows = (struct journal_row *) realloc(rows, sizeof(struct journal_row) * cap);
+            if (rows == NULL)
+            {
+                fprintf(stderr, "Out of memory reading journal %s\n", path);
+                fclose(in);
+                return NULL;
+            }
+        }
+
+        //a batch the writer died in the middle of never committed to the journal, so it isn't counted
+        if (fread(&rows[*count], sizeof(struct journal_row), batch.rows, in) != batch.rows)
+            break;
+        *count += batch.rows;
+    }
+
+    fclose(in);
+    if (rows == NULL)
+        rows = (struct journal_row *) malloc(sizeof(struct journal_row));
+    return rows;
+}
+
+int run_undo_replay(PGconn *conn, FILE *f, const char *run, int replay)
+{
+    struct journal_header hdr;
+    long count;
+    struct journal_row *rows = journal_read(run, &hdr, &count);
+    if (rows == NULL)
+        return 1;
+
+    //the rows go to the server once, then a single join does the whole delete or insert
+    PGresult *res = traced_exec(conn, "create temp table journal_rows (student_id int, crn int, grade text);");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        exit_nicely(conn, "Creating journal table");
+    PQclear(res);
+
+    struct copy_stream copy;
+    char row[64];
+    copy_begin(conn, &copy, "copy journal_rows (student_id, crn, grade) from stdin;");
+    long k;
+    for (k = 0; k < count; k++)
+    {
+        sprintf(row, "%d\t%d\t%.*s\n", rows[k].student_id, rows[k].crn, (int) sizeof(rows[k].grade), rows[k].grade);
+        copy_row(&copy, row);
+    }
+    copy_end(&copy, "Loading journal rows");
+    free(rows);
+
+    res = traced_exec(conn, "begin;");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        exit_nicely(conn, "Starting journal transaction");
+    PQclear(res);
+
+    //replay skips rows that are already there, so replaying twice (or a run that was never undone) is harmless
+    if (replay)
+        res = traced_exec(conn, "insert into registry.enrollment (student_id, crn, grade) "
+                                "select distinct j.student_id, j.crn, nullif(j.grade, '') from journal_rows j "
+                                "where not exists (select 1 from registry.enrollment e where e.student_id = j.student_id and e.crn = j.crn);");
+    else
+        res = traced_exec(conn, "delete from registry.enrollment e using journal_rows j "
+                                "where e.student_id = j.student_id and e.crn = j.crn;");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        exit_nicely(conn, replay ? "Replaying journal" : "Undoing journal");
+    char affected[32];
+    snprintf(affected, sizeof(affected), "%s", PQcmdTuples(res));
+    PQclear(res);
+
+    res = traced_exec(conn, "commit;");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        exit_nicely(conn, "Committing journal");
+    PQclear(res);
+
+    res = traced_exec(conn, "drop table journal_rows;");
+    PQclear(res);
+
+    fprintf(stderr, "%s run %.*s (seed %llu): %s of %ld journaled enrollments\n", replay ? "Replayed" : "Undid",
+            (int) sizeof(hdr.run_id), hdr.run_id, (unsigned long long) hdr.seed, affected, count);
+    if (DEBUG)
+        fprintf(f, "%s %s: %s rows\n", replay ? "Replay" : "Undo", run, affected);
+    return 0;
+}
+
+double now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+void autotune_init(struct autotune *knob, const char *name, const char *env, int value, int min, int max, int step, int backoff)
+{
+    memset(knob, 0, sizeof(*knob));
+    knob->name = name;
+    knob->env = env;
+    knob->value = value;
+    knob->min = min;
+    knob->max = max;
+    knob->step = step;
+    knob->backoff = backoff;
+    knob->direction = 1;
+
+    //a value from an earlier run's report, or a hand picked one, stays put
+    const char *pin = getenv(env);
+    if (pin != NULL && atoi(pin) > 0)
+    {
+        knob->value = atoi(pin);
+        knob->pinned = 1;
+    }
+}
+
+//feeds one window (rows done in elapsed_ms, of which latency_ms waiting on the server) and returns the value to use next
+int autotune_sample(struct autotune *knob, FILE *f, double rows, double elapsed_ms, double latency_ms)
+{
+    if (knob->pinned || rows <= 0 || elapsed_ms <= 0)
+        return knob->value;
+
+    double rate = rows * 1000.0 / elapsed_ms;
+    double per_row = latency_ms / rows;
+    int old = knob->value;
+
+    if (knob->backoff && knob->best_latency > 0 && per_row > knob->best_latency * AUTOTUNE_BACKOFF)
+    {
+        //multiplicative decrease, then grow again from there; the baseline drifts up so a server that
+        //stays slower is not backed off from forever
+        knob->value /= 2;
+        knob->direction = 1;
+        knob->best_latency *= 1.1;
+    }
+    else
+    {
+        if (knob->last_rate > 0 && rate < knob->last_rate * AUTOTUNE_WORSE)
+            knob->direction = -knob->direction;
+        knob->value += knob->direction * knob->step;
+    }
+
+    if (knob->value < knob->min)
+        knob->value = knob->min;
+    if (knob->value > knob->max)
+        knob->value = knob->max;
+    if (knob->best_latency == 0 || per_row < knob->best_latency)
+        knob->best_latency = per_row;
+    knob->last_rate = rate;
+
+    if (knob->value != old)
+    {
+        knob->changes++;
+        if (DEBUG)
+            fprintf(f, "AUTOTUNE %s %d -> %d (%.0f rows/s, %.4f ms/row on the server)\n", knob->name, old, knob->value, rate, per_row);
+    }
+    return knob->value;
+}
+
+void autotune_report(struct autotune *knob, FILE *f)
+{
+    fprintf(stderr, "AUTOTUNE %s=%d (%s, %d changes)\n", knob->env, knob->value, knob->pinned ? "pinned" : "tuned", knob->changes);
+    if (DEBUG)
+        fprintf(f, "Autotune settled %s at %d\n", knob->name, knob->value);
 }
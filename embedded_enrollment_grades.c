@@ -7,17 +7,43 @@
   registry database. Grades will be randomly selected within a range dictated by their existing gpa
   entry in the Student table.
 
+  With --incremental only students past the watermark in registry.enrollment_watermark (kept
+  under the name "grades", separately from the enrollment generator's) are graded, so a nightly
+  run after an incremental enrollment run only touches the new students. Students within
+  WATERMARK_SLACK ids below the watermark that still have ungraded enrollment are graded too, since
+  a student whose id was handed out before the last run can commit after it. Students without any
+  enrollment yet are left for a later run, and the watermark only moves up to the last student
+  actually graded, so new students waiting on their enrollment run are never skipped.
+
+  Once every student is graded, registry.student.gpa is set to the mean grade points of the grades
+  just handed out (A 4.0, A- 3.7, B+ 3.3, B 3.0, B- 2.7, C 2.0, D 1.0, F 0.0), so the two agree.
+  The points are summed in memory as grades are generated and written back with one COPY into a
+  temporary table and a single UPDATE ... FROM, instead of another pass over enrollment. Students
+  with no enrollment keep their gpa. --keep-gpa leaves gpa alone; it and --incremental can be
+  given in either order.
+
+  The connection string can be overridden with the EE_CONNINFO environment variable.
+
+  Each student, query and grade update fires a USDT tracepoint, see embedded_enrollment_trace.h.
+
+  The grade ranges are the grading policy in embedded_enrollment_policy.h, shared with the
+  generators' dry run statistics and the daemon's regrade.
+
 
   Compile as: 
-  gcc -I /usr/include/postgresql -L /usr/lib/postgresql -o embedded_enrollment embedded_enrollment.c.c -lpq
+  gcc -I /usr/include/postgresql -L /usr/lib/postgresql -o embedded_enrollment_grades embedded_enrollment_grades.c -lpq
 
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <libpq-fe.h>
+#include <string.h>
+#include "embedded_enrollment_trace.h"
+#include "embedded_enrollment_registry.h"
+#include "embedded_enrollment_policy.h"
 
-char *gen_grade(int, int, double);
+void write_gpas(PGconn *conn, int *ids, double *gpas, int count);
 
 int exit_nicely(PGconn *conn, char *loc)
 {
@@ -37,11 +63,24 @@ int main(int argc, char *argv[])
         exit (1);
     }
 
+    int incremental = 0;
+    int keep_gpa = 0;
+    int a;
+    for (a = 1; a < argc; a++)
+    {
+        if (strcmp(argv[a], "--incremental") == 0)
+            incremental = 1;
+        else if (strcmp(argv[a], "--keep-gpa") == 0)
+            keep_gpa = 1;
+    }
+
     const char *conn_info;
     PGconn *conn;
     PGresult *res;
 
-    conn_info = "host=dbclass.cs.pdx.edu user=w15db71 password=secret";
+    conn_info = getenv("EE_CONNINFO");
+    if (conn_info == NULL)
+        conn_info = "host=dbclass.cs.pdx.edu user=w15db71 password=secret";
     conn = PQconnectdb(conn_info);
 
     if (PQstatus(conn) != CONNECTION_OK)
@@ -50,9 +89,23 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    int last_id = 0;
+    if (incremental)
+    {
+        ensure_watermark_table(conn);
+        last_id = read_watermark(conn, "grades");
+    }
+
+    //only ids that exist, in order; they need not be dense or start at 1. Just below the watermark, students
+    //that committed after it moved past them are the ones with enrollment still ungraded
     char *student_buffer = (char *) malloc (sizeof(char) * 1024);
-    sprintf(student_buffer, "select s.id from registry.student s;");    
-    res = PQexec(conn, student_buffer);
+    if (incremental)
+        sprintf(student_buffer, "select s.id from registry.student s where s.id > %d and exists "
+                "(select 1 from registry.enrollment e where e.student_id = s.id and (s.id > %d or e.grade is null)) order by s.id;",
+                last_id - WATERMARK_SLACK, last_id);
+    else
+        sprintf(student_buffer, "select s.id from registry.student s order by s.id;");
+    res = traced_exec(conn, student_buffer);
 
     if (PQresultStatus(res) != PGRES_TUPLES_OK)
     {
@@ -61,19 +114,33 @@ int main(int argc, char *argv[])
     }
 
     int NUM_STUD = PQntuples(res);
-    int i;
+    int row;
+
+    //the gpa each graded student ends up with, written back in one go at the end
+    int *gpa_ids = (int *) malloc(sizeof(int) * (NUM_STUD + 1));
+    double *gpa_values = (double *) malloc(sizeof(double) * (NUM_STUD + 1));
+    int num_gpas = 0;
+    int last_graded = last_id;
     //Iterate through records FOR EACH STUDENT, joining and finding courses and CRNs to add to enrollment
-    //Student_ids start at 1 (i = 1)
-    for (i = 1; i <= NUM_STUD; i++)
+    for (row = 0; row < NUM_STUD; row++)
     {
+        int i = atoi(PQgetvalue(res, row, 0));
+        int64_t student_started = TRACE_NOW(student_done);
+        int graded = 0;
+        trace_student = i;
+        TRACE_STUDENT_START(i);
+
         //First, snag the students enrollment date
         char *gpa_buff = (char *) malloc(sizeof(char) * 1024);
         sprintf(gpa_buff, "select s.gpa from registry.student s where s.id=%d;", i);
-        PGresult *gpa_res = PQexec(conn, gpa_buff);
+        PGresult *gpa_res = traced_exec(conn, gpa_buff);
 
+        //every student_start gets its student_done, even when there is nothing to grade
         if (PQntuples(gpa_res) < 1)
         {
             PQclear(gpa_res);
+            free(gpa_buff);
+            TRACE_STUDENT_DONE(i, 0, TRACE_SINCE(student_started));
             continue;
         }
 
@@ -88,11 +155,15 @@ int main(int argc, char *argv[])
         //get number of courses for student
         char *enroll_count_buff = (char*) malloc(sizeof(char) * 1024);
         sprintf(enroll_count_buff, "select crn from registry.enrollment where student_id = %d", i);
-        PGresult *enroll_count_res = PQexec(conn, enroll_count_buff);
+        PGresult *enroll_count_res = traced_exec(conn, enroll_count_buff);
 
         if (PQntuples(enroll_count_res) < 1)
         {
             PQclear(enroll_count_res);
+            PQclear(gpa_res);
+            free(gpa_buff);
+            free(enroll_count_buff);
+            TRACE_STUDENT_DONE(i, 0, TRACE_SINCE(student_started));
             continue;
         }
  
@@ -104,33 +175,67 @@ int main(int argc, char *argv[])
 
         int enroll_count = PQntuples(enroll_count_res);
         int crn_count;
-        int threshold = 10;
+        double points = 0;
         //get crns, generate grade for each, update into table
         for (crn_count = 0; crn_count < enroll_count; crn_count++)
         {
-            char *grade = (char*) malloc(sizeof(char) * 5);
-            int random = rand_lim(20);
             int crn = atoi(PQgetvalue(enroll_count_res, crn_count, 0)); 
 
-            //gen random grade based on gpa
-            grade = gen_grade(random, threshold, gpa);
+            //gen random grade based on gpa, the same way the generators' dry runs do
+            char *grade = policy_grade(gpa, NULL);
  
             if (!grade)
                 exit_nicely(conn, "generating grade");
 
             char *update_buff = (char*) malloc(sizeof(char) * 1024);
             sprintf(update_buff, "update registry.enrollment set grade=\'%s\' where student_id = %d and crn = %d;", grade, i, crn);
-            PGresult *enroll_grade_res = PQexec(conn, update_buff);
-
-            if (PQresultStatus(enroll_grade_res) != PGRES_TUPLES_OK)
+            int64_t update_started = TRACE_NOW(grade_update);
+            PGresult *enroll_grade_res = traced_exec(conn, update_buff);
+            TRACE_GRADE_UPDATE(i, crn, grade, TRACE_SINCE(update_started));
+            free(update_buff);
+
+            //only grades that were stored count toward the gpa written back
+            if (PQresultStatus(enroll_grade_res) != PGRES_COMMAND_OK)
+            {
+                if (DEBUG)
+                    fprintf(f, "Grading student %d crn %d failed: %s", i, crn, PQerrorMessage(conn));
+                PQclear(enroll_grade_res);
                 continue;
+            }
+            PQclear(enroll_grade_res);
 
-            PQclear(enroll_grade_res); 
+            points += grade_point(grade);
+            graded++;
         }
 
         PQclear(gpa_res);
+        PQclear(enroll_count_res);
+        free(gpa_buff);
+        free(enroll_count_buff);
+
+        if (graded > 0)
+        {
+            gpa_ids[num_gpas] = i;
+            gpa_values[num_gpas] = points / graded;
+            num_gpas++;
+            if (i > last_graded)
+                last_graded = i;
+        }
+        TRACE_STUDENT_DONE(i, graded, TRACE_SINCE(student_started));
 
     } //for: each student, generate gpa
+    trace_student = 0;
+
+    if (!keep_gpa && num_gpas > 0)
+        write_gpas(conn, gpa_ids, gpa_values, num_gpas);
+    if (DEBUG)
+        fprintf(f, "Graded %d students%s\n", num_gpas, keep_gpa ? "" : ", gpa updated to match");
+    free(gpa_ids);
+    free(gpa_values);
+
+    //late students below the watermark never move it backwards
+    if (incremental && last_graded > last_id)
+        write_watermark(conn, "grades", last_graded);
  
     free(student_buffer);
     PQclear(res);
@@ -139,81 +244,31 @@ int main(int argc, char *argv[])
     return 0;
 }
 
-int rand_lim(int limit)
+void write_gpas(PGconn *conn, int *ids, double *gpas, int count)
 {
-    //return a random number between 0 and limit inclusive
-
-    int divisor = RAND_MAX/(limit+1);
-    int retval;
-
-    do {
-        retval = rand() / divisor;
-    } while (retval > limit);
-
-    if (retval > 0)
-        return retval -1;
-    else
-        return retval;
-}
+    PGresult *res = traced_exec(conn, "create temp table student_gpa (student_id int primary key, gpa numeric(3,2) not null);");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        exit_nicely(conn, "Creating gpa table");
+    PQclear(res);
 
-char *gen_grade(int random, int threshold, double gpa)
-{
-    char *grade = (char*) malloc(sizeof(char) * 5);
+    struct copy_stream copy;
+    copy_begin(conn, &copy, "copy student_gpa (student_id, gpa) from stdin;");
 
-    if (gpa >= 4.0)
-    {
-        grade = "A";
-    } 
-    else if (gpa >= 3.5)
+    char line[64];
+    int k;
+    for (k = 0; k < count; k++)
     {
-        if (random > threshold + 2)
-            grade = "A";
-        else if (random >= threshold)
-            grade = "B+";
-        else
-            grade = "B";
-    }
-    else if (gpa >= 3.0)
-    {
-        if (random > threshold + 5)
-            grade = "A";
-        else if (random >= threshold + 2)
-            grade = "B+";
-        else if (random >= threshold - 2)
-            grade = "B";
-        else
-            grade = "C";
-    }
-    else if (gpa >= 2.5)
-    {
-        if (random >= threshold + 8)
-            grade = "A";
-        else if (random >= threshold + 7)
-            grade = "B+";
-        else if (random >= threshold + 5)
-            grade = "B";
-        else if (random >= threshold + 3)
-            grade = "B-";
-        else
-            grade = "C";
-    }
-    else
-    {
-        if (random >= threshold + 10)
-            grade = "A";
-        else if (random >= threshold + 9)
-            grade = "A-";
-        else if (random >= threshold + 7)
-            grade = "B";
-        else if (random >= threshold + 5)
-            grade = "B-";
-        else if (random >= threshold)
-            grade = "C";
-        else if (random >= threshold -3)
-            grade = "D";
-        else
-            grade = "F";
+        sprintf(line, "%d\t%.2f\n", ids[k], gpas[k]);
+        copy_row(&copy, line);
     }
+    copy_end(&copy, "Copying gpas");
 
-    return grade;
+    res = traced_exec(conn, "update registry.student s set gpa = g.gpa from student_gpa g where s.id = g.student_id and s.gpa is distinct from g.gpa;");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        exit_nicely(conn, "Updating gpas");
+    fprintf(stderr, "Updated gpa for %s of %d graded students\n", PQcmdTuples(res), count);
+    PQclear(res);
+
+    res = traced_exec(conn, "drop table student_gpa;");
+    PQclear(res);
 }
@@ -0,0 +1,403 @@
+/*
+  Ian Van Houdt
+  CS 586
+  embedded_enrollment_loadtest.c
+
+  This file builds a synthetic student registry in a local PostgreSQL database and runs the
+  enrollment and grade generators against it end to end, so their behaviour can be measured at
+  sizes the class registry never gets to. It drops and recreates the registry schema, fills it
+  with COPY (departments with one major each, courses per department with prerequisite chains,
+  sections across years and quarters, students with enrollment dates, gpas and one or two
+  majors), then runs ./embedded_enrollment and ./embedded_enrollment_grades and reports, per
+  stage, wall time, rows/sec, peak RSS and the statements the server executed.
+
+  Run the same command with growing --students / --courses to get a scaling curve; --seed makes
+  the generated registry repeatable.
+
+  Because it drops the registry schema, this only runs with EE_CONNINFO set, and never against
+  the class server. The generators are started with that same EE_CONNINFO.
+
+  Usage:
+    EE_CONNINFO="dbname=loadtest" ./embedded_enrollment_loadtest [--students N] [--departments M]
+        [--courses per_department] [--years Y] [--workers W] [--seed S] [--skip-populate]
+
+  Compile as:
+  gcc -I /usr/include/postgresql -L /usr/lib/postgresql -o embedded_enrollment_loadtest embedded_enrollment_loadtest.c -lpq
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <libpq-fe.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "embedded_enrollment_registry.h"
+#include "embedded_enrollment_policy.h"
+
+#define FIRST_YEAR 2000
+#define MAX_WORKERS 64
+
+//what the server has done so far, snapshotted before and after each stage
+struct server_counts
+{
+    long statements;        //from pg_stat_statements when installed, otherwise committed transactions
+    long inserted;
+    long updated;
+};
+
+void copy_finish(struct copy_stream *copy, char *loc);
+void create_schema(PGconn *conn);
+void populate(PGconn *conn, int students, int departments, int courses, int years);
+int stats_statements_available(PGconn *conn);
+void snapshot(PGconn *conn, int have_statements, struct server_counts *counts);
+long count_rows(PGconn *conn, char *query);
+double now_secs(void);
+long run_stage(char *argv[], int copies);
+
+int exit_nicely(PGconn *conn, char *loc)
+{
+    PQfinish(conn);
+    fprintf(stderr, "\n*****Whoa, had and issue (%s)! Exiting\n", loc);
+    exit(1);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int students = 10000;
+    int departments = 25;
+    int courses = 40;
+    int years = 10;
+    int workers = 1;
+    int seed = 1;
+    int skip_populate = 0;
+
+    int a;
+    for (a = 1; a < argc; a++)
+    {
+        if (strcmp(argv[a], "--skip-populate") == 0)
+            skip_populate = 1;
+        else if (a + 1 < argc && strcmp(argv[a], "--students") == 0)
+            students = atoi(argv[++a]);
+        else if (a + 1 < argc && strcmp(argv[a], "--departments") == 0)
+            departments = atoi(argv[++a]);
+        else if (a + 1 < argc && strcmp(argv[a], "--courses") == 0)
+            courses = atoi(argv[++a]);
+        else if (a + 1 < argc && strcmp(argv[a], "--years") == 0)
+            years = atoi(argv[++a]);
+        else if (a + 1 < argc && strcmp(argv[a], "--workers") == 0)
+            workers = atoi(argv[++a]);
+        else if (a + 1 < argc && strcmp(argv[a], "--seed") == 0)
+            seed = atoi(argv[++a]);
+        else
+        {
+            fprintf(stderr, "Unknown argument %s\n", argv[a]);
+            exit (1);
+        }
+    }
+
+    if (students < 1 || departments < 1 || courses < 1 || years < 1 || workers < 1 || workers > MAX_WORKERS)
+    {
+        fprintf(stderr, "Sizes must be positive and at most %d workers\n", MAX_WORKERS);
+        exit (1);
+    }
+
+    const char *conn_info = getenv("EE_CONNINFO");
+    if (conn_info == NULL || strstr(conn_info, "dbclass") != NULL)
+    {
+        fprintf(stderr, "Set EE_CONNINFO to a local scratch database, this drops the registry schema\n");
+        exit (1);
+    }
+
+    PGconn *conn = PQconnectdb(conn_info);
+    if (PQstatus(conn) != CONNECTION_OK)
+    {
+        fprintf(stderr, "Connection to DB failed: %s\n", PQerrorMessage(conn));
+        return -1;
+    }
+
+    srand(seed);
+
+    double start;
+    if (!skip_populate)
+    {
+        start = now_secs();
+        create_schema(conn);
+        populate(conn, students, departments, courses, years);
+        fprintf(stderr, "Populated registry in %.1fs\n", now_secs() - start);
+
+        //a cache built from an earlier registry of the same size would still pass the checksum
+        const char *catalog_path = getenv("EE_CATALOG");
+        unlink(catalog_path ? catalog_path : "embedded_enrollment.catalog");
+    }
+
+    int have_statements = stats_statements_available(conn);
+    struct server_counts before, after;
+
+    printf("students=%d departments=%d courses=%d years=%d workers=%d seed=%d\n",
+           students, departments, courses, years, workers, seed);
+    printf("%-12s %10s %12s %12s %12s %12s %12s\n", "stage", "wall_s", "rows", "rows_per_s", "peak_rss_kb",
+           have_statements ? "statements" : "xacts", "tup_changed");
+
+    //enrollment: one process, or a coordinator seeding ranges for a pool of workers
+    snapshot(conn, have_statements, &before);
+    start = now_secs();
+    long rss;
+    if (workers > 1)
+    {
+        char *coordinator_argv[] = { "./embedded_enrollment", "--coordinator", NULL };
+        char *worker_argv[] = { "./embedded_enrollment", "--worker", NULL };
+        PGresult *res = PQexec(conn, "drop table if exists registry.enrollment_work;");
+        PQclear(res);
+        run_stage(coordinator_argv, 1);
+        rss = run_stage(worker_argv, workers);
+    }
+    else
+    {
+        char *enroll_argv[] = { "./embedded_enrollment", NULL };
+        rss = run_stage(enroll_argv, 1);
+    }
+    double wall = now_secs() - start;
+    snapshot(conn, have_statements, &after);
+
+    long rows = count_rows(conn, "select count(*) from registry.enrollment;");
+    printf("%-12s %10.2f %12ld %12.0f %12ld %12ld %12ld\n", "enrollment", wall, rows, rows / wall, rss,
+           after.statements - before.statements, after.inserted - before.inserted);
+
+    //grades: one update per enrollment row
+    snapshot(conn, have_statements, &before);
+    start = now_secs();
+    char *grades_argv[] = { "./embedded_enrollment_grades", NULL };
+    rss = run_stage(grades_argv, 1);
+    wall = now_secs() - start;
+    snapshot(conn, have_statements, &after);
+
+    rows = count_rows(conn, "select count(*) from registry.enrollment where grade is not null;");
+    printf("%-12s %10.2f %12ld %12.0f %12ld %12ld %12ld\n", "grades", wall, rows, rows / wall, rss,
+           after.statements - before.statements, after.updated - before.updated);
+
+    PQfinish(conn);
+    return 0;
+}
+
+void create_schema(PGconn *conn)
+{
+    PGresult *res = PQexec(conn,
+            "drop schema if exists registry cascade; "
+            "create schema registry; "
+            "create table registry.department (id int primary key, name text not null); "
+            "create table registry.major (id int primary key, department_id int not null references registry.department(id), name text not null); "
+            "create table registry.course (id int primary key, department_id int not null references registry.department(id), name text not null); "
+            "create table registry.section (crn int primary key, course_id int not null references registry.course(id), quarter text not null, year int not null); "
+            "create table registry.prerequisite (course_id int not null references registry.course(id), prereq_id int not null references registry.course(id), primary key (course_id, prereq_id)); "
+            "create table registry.student (id int primary key, enrollment_date date not null, gpa numeric(3,2) not null); "
+            "create table registry.student_major (student_id int not null references registry.student(id), major_id int not null references registry.major(id), primary key (student_id, major_id)); "
+            "create table registry.enrollment (student_id int not null references registry.student(id), crn int not null references registry.section(crn), grade text, primary key (student_id, crn));");
+
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        exit_nicely(conn, "Creating registry schema");
+    PQclear(res);
+}
+
+void populate(PGconn *conn, int students, int departments, int courses, int years)
+{
+    const char *quarters[4] = { "Winter", "Spring", "Summer", "Fall" };
+    struct copy_stream copy;
+    char row[256];
+    int d, c, y, q, s;
+
+    copy_begin(conn, &copy, "copy registry.department (id, name) from stdin;");
+    for (d = 1; d <= departments; d++)
+    {
+        sprintf(row, "%d\tDepartment %d\n", d, d);
+        copy_row(&copy, row);
+    }
+    copy_finish(&copy, "Copying departments");
+
+    //one major per department, with the same id
+    copy_begin(conn, &copy, "copy registry.major (id, department_id, name) from stdin;");
+    for (d = 1; d <= departments; d++)
+    {
+        sprintf(row, "%d\t%d\tMajor %d\n", d, d, d);
+        copy_row(&copy, row);
+    }
+    copy_finish(&copy, "Copying majors");
+
+    copy_begin(conn, &copy, "copy registry.course (id, department_id, name) from stdin;");
+    for (d = 1; d <= departments; d++)
+    {
+        for (c = 1; c <= courses; c++)
+        {
+            sprintf(row, "%d\t%d\tCourse %d-%d\n", (d - 1) * courses + c, d, d, c);
+            copy_row(&copy, row);
+        }
+    }
+    copy_finish(&copy, "Copying courses");
+
+    //each course runs in one to four random quarters every year
+    copy_begin(conn, &copy, "copy registry.section (crn, course_id, quarter, year) from stdin;");
+    int crn = 10000;
+    for (c = 1; c <= departments * courses; c++)
+    {
+        for (y = 0; y < years; y++)
+        {
+            int offered = 0;
+            for (q = 0; q < 4; q++)
+            {
+                if (rand_lim(4) > 1 || (q == 3 && offered == 0))
+                {
+                    sprintf(row, "%d\t%d\t%s\t%d\n", crn++, c, quarters[q], FIRST_YEAR + y);
+                    copy_row(&copy, row);
+                    offered++;
+                }
+            }
+        }
+    }
+    copy_finish(&copy, "Copying sections");
+
+    //prerequisite chains inside a department: a course usually requires the one before it
+    copy_begin(conn, &copy, "copy registry.prerequisite (course_id, prereq_id) from stdin;");
+    for (d = 1; d <= departments; d++)
+    {
+        for (c = 2; c <= courses; c++)
+        {
+            if (rand_lim(3) > 0)
+            {
+                sprintf(row, "%d\t%d\n", (d - 1) * courses + c, (d - 1) * courses + c - 1);
+                copy_row(&copy, row);
+            }
+        }
+    }
+    copy_finish(&copy, "Copying prerequisites");
+
+    //students enroll any time before the last year, so everybody has sections left to take
+    copy_begin(conn, &copy, "copy registry.student (id, enrollment_date, gpa) from stdin;");
+    for (s = 1; s <= students; s++)
+    {
+        sprintf(row, "%d\t%d-%02d-%02d\t%d.%02d\n", s, FIRST_YEAR + rand_lim(years > 1 ? years - 1 : 1),
+                rand_lim(12) + 1, rand_lim(28) + 1, rand_lim(3) + 1, rand_lim(100));
+        copy_row(&copy, row);
+    }
+    copy_finish(&copy, "Copying students");
+
+    copy_begin(conn, &copy, "copy registry.student_major (student_id, major_id) from stdin;");
+    for (s = 1; s <= students; s++)
+    {
+        int major = rand_lim(departments) + 1;
+        sprintf(row, "%d\t%d\n", s, major);
+        copy_row(&copy, row);
+
+        //about one in five double majors
+        if (departments > 1 && rand_lim(5) == 0)
+        {
+            sprintf(row, "%d\t%d\n", s, major % departments + 1);
+            copy_row(&copy, row);
+        }
+    }
+    copy_finish(&copy, "Copying student majors");
+
+    PGresult *res = PQexec(conn, "analyze;");
+    PQclear(res);
+}
+
+//copy_end, reporting how many rows went in
+void copy_finish(struct copy_stream *copy, char *loc)
+{
+    long rows = copy_end(copy, loc);
+    fprintf(stderr, "%s: %ld rows\n", loc, rows);
+}
+
+int stats_statements_available(PGconn *conn)
+{
+    PGresult *res = PQexec(conn, "select 1 from pg_extension where extname = 'pg_stat_statements';");
+    int available = PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) > 0;
+    PQclear(res);
+    return available;
+}
+
+void snapshot(PGconn *conn, int have_statements, struct server_counts *counts)
+{
+    //backends flush their statistics about once a second, give the last ones time to land
+    sleep(1);
+
+    PGresult *res = PQexec(conn, "select pg_stat_clear_snapshot();");
+    PQclear(res);
+
+    if (have_statements)
+        res = PQexec(conn, "select (select coalesce(sum(calls), 0) from pg_stat_statements s join pg_database d on s.dbid = d.oid "
+                           "where d.datname = current_database()), tup_inserted, tup_updated "
+                           "from pg_stat_database where datname = current_database();");
+    else
+        res = PQexec(conn, "select xact_commit + xact_rollback, tup_inserted, tup_updated "
+                           "from pg_stat_database where datname = current_database();");
+
+    if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) < 1)
+        exit_nicely(conn, "Reading server statistics");
+
+    counts->statements = atol(PQgetvalue(res, 0, 0));
+    counts->inserted = atol(PQgetvalue(res, 0, 1));
+    counts->updated = atol(PQgetvalue(res, 0, 2));
+    PQclear(res);
+}
+
+long count_rows(PGconn *conn, char *query)
+{
+    PGresult *res = PQexec(conn, query);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+        exit_nicely(conn, "Counting rows");
+
+    long rows = atol(PQgetvalue(res, 0, 0));
+    PQclear(res);
+    return rows;
+}
+
+double now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//runs copies of a generator side by side, waits for all of them and returns the largest peak RSS in kB
+long run_stage(char *argv[], int copies)
+{
+    pid_t pids[MAX_WORKERS];
+    int k;
+
+    fflush(stdout);
+    for (k = 0; k < copies; k++)
+    {
+        pids[k] = fork();
+        if (pids[k] < 0)
+        {
+            perror("fork");
+            exit (1);
+        }
+        if (pids[k] == 0)
+        {
+            execv(argv[0], argv);
+            perror(argv[0]);
+            _exit(127);
+        }
+    }
+
+    long peak_rss = 0;
+    for (k = 0; k < copies; k++)
+    {
+        int status;
+        struct rusage usage;
+        if (wait4(pids[k], &status, 0, &usage) < 0)
+            continue;
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            fprintf(stderr, "NOTE: %s exited abnormally (status %d)\n", argv[0], status);
+        if (usage.ru_maxrss > peak_rss)
+            peak_rss = usage.ru_maxrss;
+    }
+    return peak_rss;
+}
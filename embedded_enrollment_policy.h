@@ -0,0 +1,226 @@
+/*
+  Ian Van Houdt
+  CS 586
+  embedded_enrollment_policy.h
+
+  The choices that make one enrollment generator different from another, picked at compile time
+  so the generator loops call plain static inline functions and constants with nothing to dispatch
+  at run time:
+
+    majors      which majors' courses a student is offered (policy_majors)
+    acceptance  whether a candidate course goes on to section selection (policy_accept_course)
+    section     which of a course's sections is tried first (policy_first_section)
+    grading     the grade for a student with a given gpa (policy_grade)
+
+  The default is the student's own majors. Defining EE_POLICY_NON_MAJOR before including this
+  header gives the non major generator instead: two random majors the student is not in, and a
+  stricter acceptance threshold. A new variant is another #if block here plus a .c file that
+  defines its macro and includes embedded_enrollment.c, the way embedded_enrollment_non_major.c
+  does.
+
+  rand_lim, rand_lim_r, gen_grade and the grade points table live here too, so the generators and
+  the grade tool draw, grade and average grades the same way.
+
+  Every random draw takes a seed: NULL draws from rand(), anything else from that seed with
+  rand_r(), for threads that keep their own.
+
+*/
+
+#ifndef EMBEDDED_ENROLLMENT_POLICY_H
+#define EMBEDDED_ENROLLMENT_POLICY_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#define POLICY_GRADE_LIMIT 20
+#define POLICY_GRADE_THRESHOLD 10
+#define NUM_GRADES 8
+
+#ifdef EE_POLICY_NON_MAJOR
+
+#define POLICY_NAME "embedded_enrollment_non_major"
+#define POLICY_WATERMARK "non_major_enrollment"
+#define POLICY_ACCEPT_LIMIT 20
+#define POLICY_ACCEPT_THRESHOLD 10  //this number must be beat by rand in order to continue on path
+#define POLICY_NON_MAJORS 2
+#define POLICY_STUDENT_SLICE 0      //the majors are anywhere in the catalog, so targeted runs load all of it
+
+#else
+
+#define POLICY_NAME "embedded_enrollment"
+#define POLICY_WATERMARK "enrollment"
+#define POLICY_ACCEPT_LIMIT 30
+#define POLICY_ACCEPT_THRESHOLD 3   //this number must be beat by rand in order to continue on path
+#define POLICY_STUDENT_SLICE 1      //everything a student can get hangs off their own majors
+
+#endif
+
+//every letter gen_grade hands out, best first, and what each is worth toward a gpa
+static const char *grade_letters[NUM_GRADES] = { "A", "A-", "B+", "B", "B-", "C", "D", "F" };
+static const double grade_points[NUM_GRADES] = { 4.0, 3.7, 3.3, 3.0, 2.7, 2.0, 1.0, 0.0 };
+
+static inline int rand_lim(int limit)
+{
+    //return a random number between 0 and limit inclusive
+
+    int divisor = RAND_MAX/(limit+1);
+    int retval;
+
+    do {
+        retval = rand() / divisor;
+    } while (retval > limit);
+
+    if (retval > 0)
+        return retval -1;
+    else
+        return retval;
+}
+
+//rand_lim for threads: same distribution, but from the caller's own seed instead of rand()'s shared state
+static inline int rand_lim_r(unsigned int *seed, int limit)
+{
+    int divisor = RAND_MAX/(limit+1);
+    int retval;
+
+    do {
+        retval = rand_r(seed) / divisor;
+    } while (retval > limit);
+
+    if (retval > 0)
+        return retval -1;
+    else
+        return retval;
+}
+
+static inline int policy_rand(unsigned int *seed, int limit)
+{
+    return seed ? rand_lim_r(seed, limit) : rand_lim(limit);
+}
+
+static inline char *gen_grade(int random, int threshold, double gpa)
+{
+    char *grade;
+
+    if (gpa >= 4.0)
+    {
+        grade = "A";
+    }
+    else if (gpa >= 3.5)
+    {
+        if (random > threshold + 2)
+            grade = "A";
+        else if (random >= threshold)
+            grade = "B+";
+        else
+            grade = "B";
+    }
+    else if (gpa >= 3.0)
+    {
+        if (random > threshold + 5)
+            grade = "A";
+        else if (random >= threshold + 2)
+            grade = "B+";
+        else if (random >= threshold - 2)
+            grade = "B";
+        else
+            grade = "C";
+    }
+    else if (gpa >= 2.5)
+    {
+        if (random >= threshold + 8)
+            grade = "A";
+        else if (random >= threshold + 7)
+            grade = "B+";
+        else if (random >= threshold + 5)
+            grade = "B";
+        else if (random >= threshold + 3)
+            grade = "B-";
+        else
+            grade = "C";
+    }
+    else
+    {
+        if (random >= threshold + 10)
+            grade = "A";
+        else if (random >= threshold + 9)
+            grade = "A-";
+        else if (random >= threshold + 7)
+            grade = "B";
+        else if (random >= threshold + 5)
+            grade = "B-";
+        else if (random >= threshold)
+            grade = "C";
+        else if (random >= threshold -3)
+            grade = "D";
+        else
+            grade = "F";
+    }
+
+    return grade;
+}
+
+static inline int grade_index(const char *grade)
+{
+    int g;
+    for (g = 0; g < NUM_GRADES; g++)
+    {
+        if (strcmp(grade, grade_letters[g]) == 0)
+            return g;
+    }
+    return NUM_GRADES - 1;
+}
+
+static inline double grade_point(const char *grade)
+{
+    return grade_points[grade_index(grade)];
+}
+
+//writes the majors to offer into out (room for max_out) from the student's own, returns how many
+static inline int policy_majors(const int *own, int num_own, int *out, int max_out, int max_major, unsigned int *seed)
+{
+#ifdef EE_POLICY_NON_MAJOR
+    //randomly generate a set of majors that are NOT the student's major(s), each picked once
+    int count = 0;
+    int tries;
+    for (tries = 0; count < POLICY_NON_MAJORS && count < max_out && tries < 100; tries++)
+    {
+        int random = policy_rand(seed, max_major + 1);
+        int nogood = 0;
+        int k;
+        for (k = 0; k < num_own && !nogood; k++)
+            nogood = own[k] == random;
+        for (k = 0; k < count && !nogood; k++)
+            nogood = out[k] == random;
+
+        if (!nogood)
+            out[count++] = random;
+    }
+    return count;
+#else
+    (void) max_major;
+    (void) seed;
+    int count = num_own < max_out ? num_own : max_out;
+    int k;
+    for (k = 0; k < count; k++)
+        out[k] = own[k];
+    return count;
+#endif
+}
+
+static inline int policy_accept_course(unsigned int *seed)
+{
+    return policy_rand(seed, POLICY_ACCEPT_LIMIT) >= POLICY_ACCEPT_THRESHOLD;
+}
+
+//index of the section to try first; when it is full the caller walks on to the next that fits
+static inline int policy_first_section(int num_sections, unsigned int *seed)
+{
+    return policy_rand(seed, num_sections);
+}
+
+static inline char *policy_grade(double gpa, unsigned int *seed)
+{
+    return gen_grade(policy_rand(seed, POLICY_GRADE_LIMIT), POLICY_GRADE_THRESHOLD, gpa);
+}
+
+#endif
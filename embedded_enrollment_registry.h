@@ -0,0 +1,191 @@
+/*
+  Ian Van Houdt
+  CS 586
+  embedded_enrollment_registry.h
+
+  What the enrollment tools share about talking to the student registry: traced queries, so a query
+  issued by the grade tool is traced and counted the same way as one from the generator, and the
+  buffered COPY ... FROM STDIN writer the generator and the load test fill tables with, the per
+  generator watermarks of incremental runs, the name of the prerequisite column that holds the required course,
+  and the registry's quarter calendar, so the validator reads terms and start terms exactly the way
+  the generator wrote them.
+
+  Every tool defines its own exit_nicely (the generator's unwinds a worker range or a daemon
+  request instead of exiting), and these helpers call whichever one the including file has.
+
+*/
+
+#ifndef EMBEDDED_ENROLLMENT_REGISTRY_H
+#define EMBEDDED_ENROLLMENT_REGISTRY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libpq-fe.h>
+#include "embedded_enrollment_trace.h"
+
+#define COPY_BUFFER_SIZE 65536
+//ids just below an incremental watermark that are looked at again: serial ids are handed out before
+//commit, so a student can show up below the watermark after a run already moved past their id
+#define WATERMARK_SLACK 1000
+//prerequisite is (course_id, PREREQ_COLUMN); a registry that names the required course differently builds with
+//-DPREREQ_COLUMN='"<name>"' rather than having it guessed, since a wrong column would pass every query unnoticed
+#ifndef PREREQ_COLUMN
+#define PREREQ_COLUMN "prereq_id"
+#endif
+
+#define NUM_QUARTERS 4
+#define QUARTER_WINTER 0
+#define QUARTER_SPRING 1
+#define QUARTER_SUMMER 2
+#define QUARTER_FALL 3
+
+//a COPY ... FROM STDIN in progress
+struct copy_stream
+{
+    PGconn *conn;
+    char *buffer;
+    int used;
+    long rows;
+};
+
+int exit_nicely(PGconn *conn, char *loc);
+
+static const char *quarter_names[NUM_QUARTERS] = { "Winter", "Spring", "Summer", "Fall" };
+//a student who enrolled after this month can't start in that quarter of the same year
+static const int quarter_last_month[NUM_QUARTERS] = { 2, 4, 7, 10 };
+
+//every query issued through traced_exec / traced_exec_params
+static long queries_issued = 0;
+//the student the current queries are about, 0 for catalog and bulk queries; passed to the query probes
+static int trace_student = 0;
+
+//PQexec between the query_start and query_done tracepoints
+static inline PGresult *traced_exec(PGconn *conn, const char *query)
+{
+    int64_t started = TRACE_NOW(query_done);
+    TRACE_QUERY_START(trace_student, query);
+    queries_issued++;
+    PGresult *res = PQexec(conn, query);
+    TRACE_QUERY_DONE(trace_student, (int) PQresultStatus(res), TRACE_SINCE(started));
+    return res;
+}
+
+static inline PGresult *traced_exec_params(PGconn *conn, const char *command, int nParams, const Oid *paramTypes,
+                                           const char *const *paramValues, const int *paramLengths, const int *paramFormats, int resultFormat)
+{
+    int64_t started = TRACE_NOW(query_done);
+    TRACE_QUERY_START(trace_student, command);
+    queries_issued++;
+    PGresult *res = PQexecParams(conn, command, nParams, paramTypes, paramValues, paramLengths, paramFormats, resultFormat);
+    TRACE_QUERY_DONE(trace_student, (int) PQresultStatus(res), TRACE_SINCE(started));
+    return res;
+}
+
+static inline void copy_begin(PGconn *conn, struct copy_stream *copy, char *command)
+{
+    PGresult *res = traced_exec(conn, command);
+    if (PQresultStatus(res) != PGRES_COPY_IN)
+        exit_nicely(conn, command);
+    PQclear(res);
+
+    copy->conn = conn;
+    copy->buffer = (char *) malloc(sizeof(char) * COPY_BUFFER_SIZE);
+    copy->used = 0;
+    copy->rows = 0;
+}
+
+static inline void copy_row(struct copy_stream *copy, char *row)
+{
+    int len = strlen(row);
+    if (copy->used + len > COPY_BUFFER_SIZE)
+    {
+        if (PQputCopyData(copy->conn, copy->buffer, copy->used) != 1)
+            exit_nicely(copy->conn, "Sending COPY data");
+        copy->used = 0;
+    }
+
+    memcpy(copy->buffer + copy->used, row, len);
+    copy->used += len;
+    copy->rows++;
+}
+
+//sends what is buffered and finishes the COPY; returns the rows it carried
+static inline long copy_end(struct copy_stream *copy, char *loc)
+{
+    if (copy->used > 0 && PQputCopyData(copy->conn, copy->buffer, copy->used) != 1)
+        exit_nicely(copy->conn, loc);
+    if (PQputCopyEnd(copy->conn, NULL) != 1)
+        exit_nicely(copy->conn, loc);
+
+    PGresult *res = PQgetResult(copy->conn);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        exit_nicely(copy->conn, loc);
+    PQclear(res);
+
+    free(copy->buffer);
+    return copy->rows;
+}
+
+static inline void ensure_watermark_table(PGconn *conn)
+{
+    PGresult *res = traced_exec(conn, "create table if not exists registry.enrollment_watermark ("
+                                 "generator text primary key, "
+                                 "last_student_id int not null, "
+                                 "updated_at timestamptz not null default now());");
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        exit_nicely(conn, "Creating watermark table");
+    PQclear(res);
+}
+
+static inline int read_watermark(PGconn *conn, const char *generator)
+{
+    const char *params[1] = { generator };
+    PGresult *res = traced_exec_params(conn, "select last_student_id from registry.enrollment_watermark where generator = $1;",
+                                 1, NULL, params, NULL, NULL, 0);
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+        exit_nicely(conn, "Reading watermark");
+
+    int last_id = PQntuples(res) > 0 ? atoi(PQgetvalue(res, 0, 0)) : 0;
+    PQclear(res);
+    return last_id;
+}
+
+static inline void write_watermark(PGconn *conn, const char *generator, int last_id)
+{
+    char id_param[32];
+    sprintf(id_param, "%d", last_id);
+    const char *params[2] = { generator, id_param };
+
+    PGresult *res = traced_exec_params(conn, "insert into registry.enrollment_watermark (generator, last_student_id) values ($1, $2) "
+                                       "on conflict (generator) do update set last_student_id = excluded.last_student_id, updated_at = now();",
+                                 2, NULL, params, NULL, NULL, 0);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        exit_nicely(conn, "Writing watermark");
+    PQclear(res);
+}
+
+static inline int quarter_index(const char *quarter)
+{
+    int q;
+    for (q = 0; q < NUM_QUARTERS; q++)
+    {
+        if (strcmp(quarter, quarter_names[q]) == 0)
+            return q;
+    }
+
+    fprintf(stderr, "Error Parsing Term\n");
+    return QUARTER_FALL;
+}
+
+//year * NUM_QUARTERS + quarter of the first term a student who enrolled in year/month may take
+static inline int start_term_of(int year, int month)
+{
+    //earliest quarter whose cutoff month the student made, rolling into next Winter after Fall
+    int q = 0;
+    while (q < NUM_QUARTERS && month > quarter_last_month[q])
+        q++;
+    return year * NUM_QUARTERS + q;
+}
+
+#endif
@@ -0,0 +1,108 @@
+/*
+  Ian Van Houdt
+  CS 586
+  embedded_enrollment_trace.h
+
+  Static tracepoints (USDT) for the enrollment and grade generators, under the provider
+  embedded_enrollment. Every probe has a semaphore the tracer sets while it is attached; until
+  then a probe is one predicted-not-taken test of that semaphore, and neither its arguments nor
+  the latency clock behind them are evaluated, so they stay in production builds:
+
+    student_start   (student_id)
+    student_done    (student_id, enrollments added, latency ns)
+    query_start     (student_id, query text)
+    query_done      (student_id, PQresultStatus, latency ns)
+    course_reject   (student_id, course_id, reason)
+    section_select  (student_id, course_id, crn)
+    insert          (student_id, crn, latency ns)
+    grade_update    (student_id, crn, grade, latency ns)
+
+  student_id is 0 for queries that are not about one student (catalog, work ranges, COPY).
+
+  List them with:   bpftrace -l 'usdt:./embedded_enrollment:*'
+  Query latency:    bpftrace -e 'usdt:./embedded_enrollment:query_done { @ns = hist(arg2); }'
+
+  Latencies are taken as  started = TRACE_NOW(probe); ... TRACE_SINCE(started),  where probe is
+  the one that reports them; TRACE_NOW reads the clock only while that probe is attached, and a
+  start taken before the tracer attached reports 0.
+
+  They need sys/sdt.h (systemtap-sdt-dev / systemtap-sdt-devel). Without it every TRACE_ macro
+  compiles to nothing and the latency clock is never read.
+
+*/
+
+#ifndef EMBEDDED_ENROLLMENT_TRACE_H
+#define EMBEDDED_ENROLLMENT_TRACE_H
+
+#include <stdint.h>
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define EE_TRACING 1
+#endif
+#endif
+
+#ifdef EE_TRACING
+
+#include <time.h>
+
+//the semaphores sys/sdt.h expects for each probe, named <provider>_<probe>_semaphore as dtrace -G would make them
+#define TRACE_SEMAPHORE(probe) \
+    __extension__ unsigned short embedded_enrollment_##probe##_semaphore __attribute__((unused)) __attribute__((section(".probes")))
+
+TRACE_SEMAPHORE(student_start);
+TRACE_SEMAPHORE(student_done);
+TRACE_SEMAPHORE(query_start);
+TRACE_SEMAPHORE(query_done);
+TRACE_SEMAPHORE(course_reject);
+TRACE_SEMAPHORE(section_select);
+TRACE_SEMAPHORE(insert);
+TRACE_SEMAPHORE(grade_update);
+
+#define TRACE_ENABLED(probe) __builtin_expect(embedded_enrollment_##probe##_semaphore, 0)
+
+static inline int64_t trace_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+#define TRACE_NOW(probe) (TRACE_ENABLED(probe) ? trace_now_ns() : (int64_t) 0)
+#define TRACE_SINCE(started) ((started) ? trace_now_ns() - (started) : (int64_t) 0)
+#define TRACE_STUDENT_START(student) \
+    do { if (TRACE_ENABLED(student_start)) DTRACE_PROBE1(embedded_enrollment, student_start, student); } while (0)
+#define TRACE_STUDENT_DONE(student, rows, ns) \
+    do { if (TRACE_ENABLED(student_done)) DTRACE_PROBE3(embedded_enrollment, student_done, student, rows, ns); } while (0)
+#define TRACE_QUERY_START(student, query) \
+    do { if (TRACE_ENABLED(query_start)) DTRACE_PROBE2(embedded_enrollment, query_start, student, query); } while (0)
+#define TRACE_QUERY_DONE(student, status, ns) \
+    do { if (TRACE_ENABLED(query_done)) DTRACE_PROBE3(embedded_enrollment, query_done, student, status, ns); } while (0)
+#define TRACE_COURSE_REJECT(student, course, reason) \
+    do { if (TRACE_ENABLED(course_reject)) DTRACE_PROBE3(embedded_enrollment, course_reject, student, course, reason); } while (0)
+#define TRACE_SECTION_SELECT(student, course, crn) \
+    do { if (TRACE_ENABLED(section_select)) DTRACE_PROBE3(embedded_enrollment, section_select, student, course, crn); } while (0)
+#define TRACE_INSERT(student, crn, ns) \
+    do { if (TRACE_ENABLED(insert)) DTRACE_PROBE3(embedded_enrollment, insert, student, crn, ns); } while (0)
+#define TRACE_GRADE_UPDATE(student, crn, grade, ns) \
+    do { if (TRACE_ENABLED(grade_update)) DTRACE_PROBE4(embedded_enrollment, grade_update, student, crn, grade, ns); } while (0)
+
+#else
+
+//arguments are still "used" so callers don't grow unused variable warnings, but nothing is evaluated at run time
+#define TRACE_NOW(probe) ((int64_t) 0)
+#define TRACE_SINCE(started) ((int64_t) 0 * (started))
+#define TRACE_STUDENT_START(student) ((void) sizeof(student))
+#define TRACE_STUDENT_DONE(student, rows, ns) ((void) sizeof(student), (void) sizeof(rows), (void) sizeof(ns))
+#define TRACE_QUERY_START(student, query) ((void) sizeof(student), (void) sizeof(query))
+#define TRACE_QUERY_DONE(student, status, ns) ((void) sizeof(student), (void) sizeof(status), (void) sizeof(ns))
+#define TRACE_COURSE_REJECT(student, course, reason) ((void) sizeof(student), (void) sizeof(course), (void) sizeof(reason))
+#define TRACE_SECTION_SELECT(student, course, crn) ((void) sizeof(student), (void) sizeof(course), (void) sizeof(crn))
+#define TRACE_INSERT(student, crn, ns) ((void) sizeof(student), (void) sizeof(crn), (void) sizeof(ns))
+#define TRACE_GRADE_UPDATE(student, crn, grade, ns) ((void) sizeof(student), (void) sizeof(crn), (void) sizeof(grade), (void) sizeof(ns))
+
+#endif
+
+#endif
@@ -0,0 +1,429 @@
+/*
+  Ian Van Houdt
+  CS 586
+  embedded_enrollment_validate.c
+
+  This file checks the enrollment records in the student registry database against every rule
+  the enrollment generator is meant to follow, instead of pruning the results by hand:
+
+    - a student takes at most 4 sections per term
+    - no section is before the term the student enrolled in
+    - a student takes each course at most once
+    - every prerequisite of a course was taken in an earlier term
+
+  Enrollment (joined to section), student and prerequisite data are bulk loaded with COPY and
+  then checked in parallel, one thread per slice of students. Each student's rows are walked in
+  term order and checked against the rows kept so far, so dropping a row also fails whatever
+  depended on it, and the delete list leaves behind a registry that passes every check.
+
+  The violating (student_id, crn) rows are written as COPY text, ready for:
+    create temp table doomed (student_id int, crn int);
+    \copy doomed from 'violations.txt'
+    delete from registry.enrollment e using doomed d where e.student_id = d.student_id and e.crn = d.crn;
+
+  Usage:
+    ./embedded_enrollment_validate [--threads N] [output_file]    (output defaults to stdout)
+
+  Compile as:
+  gcc -I /usr/include/postgresql -L /usr/lib/postgresql -o embedded_enrollment_validate embedded_enrollment_validate.c -lpq -lpthread
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <libpq-fe.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "embedded_enrollment_registry.h"
+
+#define MAX_PER_TERM 4
+#define MAX_THREADS 64
+
+#define VIOLATION_TOO_EARLY 0
+#define VIOLATION_DUPLICATE 1
+#define VIOLATION_PREREQ 2
+#define VIOLATION_TERM_FULL 3
+#define NUM_VIOLATIONS 4
+
+struct enrollment_row
+{
+    int student_id;
+    int crn;
+    int course;
+    int term;       //year * NUM_QUARTERS + quarter, so terms compare in calendar order
+};
+
+//one thread's slice of the (student ordered) enrollment rows and what it found there
+struct partition
+{
+    long first;
+    long last;      //exclusive
+    char *out;
+    size_t out_used;
+    size_t out_cap;
+    long violations[NUM_VIOLATIONS];
+};
+
+int exit_nicely(PGconn *conn, char *loc);
+void load_students(PGconn *conn);
+void load_prereqs(PGconn *conn);
+void load_enrollment(PGconn *conn);
+void split_rows(struct partition *parts, int threads);
+void *check_partition(void *arg);
+void emit(struct partition *part, struct enrollment_row *row, int violation);
+int compare_rows(const void *a, const void *b);
+
+const char *violation_names[NUM_VIOLATIONS] = { "section before enrollment date", "course taken twice",
+                                                "prerequisite not taken earlier", "more than 4 sections in a term" };
+
+//first term each student may take, indexed by student id, -1 for ids with no student row
+int *first_term = NULL;
+int max_student = 0;
+
+//prerequisites in the same start-array-plus-values layout as the generator's catalog
+int *prereq_start = NULL;
+int *prereqs = NULL;
+int max_course = 0;
+
+struct enrollment_row *rows = NULL;
+long num_rows = 0;
+
+
+int main(int argc, char *argv[])
+{
+    int threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    char *out_path = NULL;
+
+    int a;
+    for (a = 1; a < argc; a++)
+    {
+        if (a + 1 < argc && strcmp(argv[a], "--threads") == 0)
+            threads = atoi(argv[++a]);
+        else
+            out_path = argv[a];
+    }
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+
+    FILE *out = stdout;
+    if (out_path != NULL)
+    {
+        out = fopen(out_path, "w");
+        if (out == NULL)
+        {
+            fprintf(stderr, "Issue opening output file\n");
+            exit (1);
+        }
+    }
+
+    const char *conn_info = getenv("EE_CONNINFO");
+    if (conn_info == NULL)
+        conn_info = "host=dbclass.cs.pdx.edu user=w15db71 password=secret";
+    PGconn *conn = PQconnectdb(conn_info);
+
+    if (PQstatus(conn) != CONNECTION_OK)
+    {
+        fprintf(stderr, "Connection to DB failed: %s\n", PQerrorMessage(conn));
+        return -1;
+    }
+
+    load_students(conn);
+    load_prereqs(conn);
+    load_enrollment(conn);
+    PQfinish(conn);
+
+    struct partition parts[MAX_THREADS];
+    pthread_t tids[MAX_THREADS];
+    int t;
+    split_rows(parts, threads);
+    for (t = 0; t < threads; t++)
+    {
+        if (pthread_create(&tids[t], NULL, check_partition, &parts[t]) != 0)
+        {
+            fprintf(stderr, "Issue starting thread\n");
+            exit (1);
+        }
+    }
+
+    long violations[NUM_VIOLATIONS] = { 0 };
+    long total = 0;
+    int v;
+    for (t = 0; t < threads; t++)
+    {
+        pthread_join(tids[t], NULL);
+        fwrite(parts[t].out, 1, parts[t].out_used, out);
+        free(parts[t].out);
+        for (v = 0; v < NUM_VIOLATIONS; v++)
+        {
+            violations[v] += parts[t].violations[v];
+            total += parts[t].violations[v];
+        }
+    }
+
+    if (out != stdout)
+        fclose(out);
+
+    fprintf(stderr, "Checked %ld enrollments with %d threads, %ld to delete\n", num_rows, threads, total);
+    for (v = 0; v < NUM_VIOLATIONS; v++)
+        fprintf(stderr, "  %-32s %ld\n", violation_names[v], violations[v]);
+
+    return total > 0 ? 2 : 0;
+}
+
+int exit_nicely(PGconn *conn, char *loc)
+{
+    PQfinish(conn);
+    fprintf(stderr, "\n*****Whoa, had and issue (%s)! Exiting\n", loc);
+    exit(1);
+}
+
+void load_students(PGconn *conn)
+{
+    PGresult *res = PQexec(conn, "select coalesce(max(id), 0) from registry.student;");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+        exit_nicely(conn, "Getting student id range");
+    max_student = atoi(PQgetvalue(res, 0, 0));
+    PQclear(res);
+
+    first_term = (int *) malloc(sizeof(int) * (max_student + 1));
+    memset(first_term, 0xff, sizeof(int) * (max_student + 1));
+
+    res = PQexec(conn, "copy (select id, to_char(enrollment_date, 'YYYY-MM-DD') from registry.student where enrollment_date is not null) to stdout;");
+    if (PQresultStatus(res) != PGRES_COPY_OUT)
+        exit_nicely(conn, "Copying students");
+    PQclear(res);
+
+    char *line;
+    int len;
+    while ((len = PQgetCopyData(conn, &line, 0)) > 0)
+    {
+        //id \t yyyy-mm-dd
+        int id, year, month, day;
+        if (sscanf(line, "%d\t%d-%d-%d", &id, &year, &month, &day) == 4 && id >= 0 && id <= max_student)
+            first_term[id] = start_term_of(year, month);
+        PQfreemem(line);
+    }
+
+    res = PQgetResult(conn);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        exit_nicely(conn, "Copying students");
+    PQclear(res);
+}
+
+void load_prereqs(PGconn *conn)
+{
+    PGresult *res = PQexec(conn, "select p.course_id, p." PREREQ_COLUMN " from registry.prerequisite p order by p.course_id;");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+        exit_nicely(conn, "Loading prerequisites");
+
+    int course_col = 0;
+    int req_col = 1;
+    int n = PQntuples(res);
+    int r;
+
+    for (r = 0; r < n; r++)
+    {
+        if (atoi(PQgetvalue(res, r, course_col)) > max_course)
+            max_course = atoi(PQgetvalue(res, r, course_col));
+    }
+
+    prereq_start = (int *) calloc(max_course + 2, sizeof(int));
+    prereqs = (int *) malloc(sizeof(int) * (n + 1));
+    for (r = 0; r < n; r++)
+        prereq_start[atoi(PQgetvalue(res, r, course_col)) + 1]++;
+    for (r = 0; r <= max_course; r++)
+        prereq_start[r + 1] += prereq_start[r];
+    for (r = 0; r < n; r++)
+        prereqs[r] = atoi(PQgetvalue(res, r, req_col));
+
+    PQclear(res);
+}
+
+void load_enrollment(PGconn *conn)
+{
+    PGresult *res = PQexec(conn, "select count(*) from registry.enrollment;");
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+        exit_nicely(conn, "Counting enrollment");
+    long expected = atol(PQgetvalue(res, 0, 0));
+    PQclear(res);
+
+    long cap = expected + 1024;
+    rows = (struct enrollment_row *) malloc(sizeof(struct enrollment_row) * cap);
+
+    res = PQexec(conn, "copy (select e.student_id, e.crn, s.course_id, s.year, s.quarter from registry.enrollment e "
+                       "join registry.section s on s.crn = e.crn order by e.student_id) to stdout;");
+    if (PQresultStatus(res) != PGRES_COPY_OUT)
+        exit_nicely(conn, "Copying enrollment");
+    PQclear(res);
+
+    char *line;
+    int len;
+    while ((len = PQgetCopyData(conn, &line, 0)) > 0)
+    {
+        int student_id, crn, course, year;
+        char quarter[16];
+        if (sscanf(line, "%d\t%d\t%d\t%d\t%15s", &student_id, &crn, &course, &year, quarter) == 5)
+        {
+            //rows may have been added since the count
+            if (num_rows == cap)
+            {
+                cap *= 2;
+                rows = (struct enrollment_row *) realloc(rows, sizeof(struct enrollment_row) * cap);
+            }
+            rows[num_rows].student_id = student_id;
+            rows[num_rows].crn = crn;
+            rows[num_rows].course = course;
+            rows[num_rows].term = year * NUM_QUARTERS + quarter_index(quarter);
+            num_rows++;
+        }
+        PQfreemem(line);
+    }
+
+    res = PQgetResult(conn);
+    if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        exit_nicely(conn, "Copying enrollment");
+    PQclear(res);
+}
+
+//rows come back ordered by student, so slices only need their edges moved to a student boundary
+void split_rows(struct partition *parts, int threads)
+{
+    int t;
+    long first = 0;
+    for (t = 0; t < threads; t++)
+    {
+        //with more threads than rows the even cut can land behind the last slice, which was pushed
+        //forward to a student boundary; such a slice is empty rather than reaching back into it
+        long last = (t == threads - 1) ? num_rows : num_rows * (t + 1) / threads;
+        if (last < first)
+            last = first;
+        while (last > first && last < num_rows && rows[last].student_id == rows[last - 1].student_id)
+            last++;
+
+        memset(&parts[t], 0, sizeof(struct partition));
+        parts[t].first = first;
+        parts[t].last = last;
+        first = last;
+    }
+}
+
+void *check_partition(void *arg)
+{
+    struct partition *part = (struct partition *) arg;
+    struct enrollment_row **kept = NULL;
+    long kept_cap = 0;
+    long r = part->first;
+
+    while (r < part->last)
+    {
+        //one student's rows, walked oldest term first
+        long end = r;
+        while (end < part->last && rows[end].student_id == rows[r].student_id)
+            end++;
+        qsort(&rows[r], end - r, sizeof(struct enrollment_row), compare_rows);
+
+        //a student keeps at most all of their rows
+        if (end - r > kept_cap)
+        {
+            kept_cap = end - r;
+            kept = (struct enrollment_row **) realloc(kept, sizeof(struct enrollment_row *) * kept_cap);
+            if (kept == NULL)
+            {
+                fprintf(stderr, "Out of memory checking student %d\n", rows[r].student_id);
+                exit (1);
+            }
+        }
+
+        int student_id = rows[r].student_id;
+        int start_term = (student_id >= 0 && student_id <= max_student) ? first_term[student_id] : -1;
+        long num_kept = 0;
+
+        for (; r < end; r++)
+        {
+            struct enrollment_row *row = &rows[r];
+            long k;
+
+            if (start_term < 0 || row->term < start_term)
+            {
+                emit(part, row, VIOLATION_TOO_EARLY);
+                continue;
+            }
+
+            int duplicate = 0;
+            int in_term = 0;
+            for (k = 0; k < num_kept; k++)
+            {
+                if (kept[k]->course == row->course)
+                    duplicate = 1;
+                if (kept[k]->term == row->term)
+                    in_term++;
+            }
+            if (duplicate)
+            {
+                emit(part, row, VIOLATION_DUPLICATE);
+                continue;
+            }
+
+            //every prerequisite has to be among the kept rows of an earlier term
+            int missing = 0;
+            if (row->course >= 0 && row->course <= max_course)
+            {
+                int p;
+                for (p = prereq_start[row->course]; p < prereq_start[row->course + 1] && !missing; p++)
+                {
+                    missing = 1;
+                    for (k = 0; k < num_kept; k++)
+                    {
+                        if (kept[k]->course == prereqs[p] && kept[k]->term < row->term)
+                        {
+                            missing = 0;
+                            break;
+                        }
+                    }
+                }
+            }
+            if (missing)
+            {
+                emit(part, row, VIOLATION_PREREQ);
+                continue;
+            }
+
+            if (in_term >= MAX_PER_TERM)
+            {
+                emit(part, row, VIOLATION_TERM_FULL);
+                continue;
+            }
+
+            kept[num_kept++] = row;
+        }
+    }
+
+    free(kept);
+    return NULL;
+}
+
+void emit(struct partition *part, struct enrollment_row *row, int violation)
+{
+    if (part->out_used + 32 > part->out_cap)
+    {
+        part->out_cap = part->out_cap ? part->out_cap * 2 : 65536;
+        part->out = (char *) realloc(part->out, part->out_cap);
+    }
+
+    part->out_used += sprintf(part->out + part->out_used, "%d\t%d\n", row->student_id, row->crn);
+    part->violations[violation]++;
+}
+
+int compare_rows(const void *a, const void *b)
+{
+    const struct enrollment_row *ra = (const struct enrollment_row *) a;
+    const struct enrollment_row *rb = (const struct enrollment_row *) b;
+
+    if (ra->term != rb->term)
+        return ra->term - rb->term;
+    return ra->crn - rb->crn;
+}